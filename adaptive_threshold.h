@@ -0,0 +1,85 @@
+#ifndef ADAPTIVE_THRESHOLD_H
+#define ADAPTIVE_THRESHOLD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+// Closed-loop controllers that keep the FAST keypoint count of a stream near a
+// target. Both act on the log of count / target, since the number of FAST
+// responses falls off roughly exponentially with the threshold, and hold still
+// while the count is within ~10% of the target instead of chasing noise.
+constexpr double kKeypointCountDeadBand = 0.1;
+
+// log(count / target), or 0 inside the dead band
+inline double KeypointCountError(size_t keypoint_count, int target_keypoints) {
+    double error = std::log((keypoint_count + 1.0) / (target_keypoints + 1.0));
+    return std::abs(error) < kKeypointCountDeadBand ? 0.0 : error;
+}
+
+// Per-frame mode: detect with Threshold(), then Update() with the count. Used
+// by the host side FAST in video_track.
+class AdaptiveThreshold {
+public:
+    explicit AdaptiveThreshold(int target_keypoints, int initial_threshold = 20,
+                               int min_threshold = 5, int max_threshold = 120)
+        : target_keypoints_(std::max(target_keypoints, 1)),
+          min_threshold_(min_threshold),
+          max_threshold_(max_threshold),
+          threshold_(initial_threshold) {}
+
+    int TargetKeypoints() const { return target_keypoints_; }
+    int Threshold() const { return static_cast<int>(std::lround(threshold_)); }
+
+    // Feed back the keypoint count of the frame that was just detected
+    void Update(size_t keypoint_count) {
+        double error = KeypointCountError(keypoint_count, target_keypoints_);
+        threshold_ = std::min(std::max(threshold_ + kThresholdGain * error,
+                                       static_cast<double>(min_threshold_)),
+                              static_cast<double>(max_threshold_));
+    }
+
+private:
+    static constexpr double kThresholdGain = 4.0;
+
+    int target_keypoints_;
+    int min_threshold_;
+    int max_threshold_;
+    double threshold_;
+};
+
+// Histogram mode, see OpenCLHelper::FASTAdaptive: the device scores the frame
+// at MinThreshold() and each grid cell keeps its strongest responses until its
+// share of CandidateTarget() is reached. Update() rescales CandidateTarget() to
+// absorb how many candidates NMS removes and how far ties at a cell's cutoff
+// score overshoot its share, within [target / 4, 16 * target].
+class AdaptiveCandidateTarget {
+public:
+    explicit AdaptiveCandidateTarget(int target_keypoints, int min_threshold = 5)
+        : target_keypoints_(std::max(target_keypoints, 1)),
+          min_threshold_(min_threshold),
+          candidate_target_(2.0 * target_keypoints_) {}
+
+    int TargetKeypoints() const { return target_keypoints_; }
+    int MinThreshold() const { return min_threshold_; }
+    int CandidateTarget() const { return static_cast<int>(std::lround(candidate_target_)); }
+
+    // Feed back the keypoint count of the frame that was just detected
+    void Update(size_t keypoint_count) {
+        double error = KeypointCountError(keypoint_count, target_keypoints_);
+        candidate_target_ = std::min(std::max(candidate_target_ * std::exp(-kCandidateGain * error),
+                                              kMinCandidateRatio * target_keypoints_),
+                                     kMaxCandidateRatio * target_keypoints_);
+    }
+
+private:
+    static constexpr double kCandidateGain = 0.5;
+    static constexpr double kMinCandidateRatio = 0.25;
+    static constexpr double kMaxCandidateRatio = 16.0;
+
+    int target_keypoints_;
+    int min_threshold_;
+    double candidate_target_;
+};
+
+#endif // ADAPTIVE_THRESHOLD_H
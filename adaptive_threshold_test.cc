@@ -0,0 +1,183 @@
+#include "opencv2/opencv.hpp"
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "opencl_helper.h"
+
+#include "adaptive_threshold.h"
+#include "fast_test_util.h"
+
+// Keypoint count controllers from adaptive_threshold.h.
+//
+//   adaptive_threshold_test unit                    dead band, clamping and settling on a model
+//   adaptive_threshold_test opencl path/to/fast.cl  FASTAdaptive over a synthetic frame sequence
+
+namespace {
+
+const int kTargetKeypoints = 500;
+// Frames per texture, and how many of them the controller may take to settle
+const int kFramesPerTexture = 12;
+const int kSettleFrames = 6;
+
+bool InDeadBand(size_t keypoint_count, int target_keypoints) {
+  return std::abs(std::log((keypoint_count + 1.0) / (target_keypoints + 1.0))) <
+         kKeypointCountDeadBand;
+}
+
+int RunUnit() {
+  bool ok = true;
+
+  ok = Check(KeypointCountError(1050, 1000) == 0.0, "error is zero inside the dead band") && ok;
+  ok = Check(KeypointCountError(2000, 1000) > 0.0, "error is positive above the target") && ok;
+  ok = Check(KeypointCountError(500, 1000) < 0.0, "error is negative below the target") && ok;
+
+  // Per-frame mode
+  {
+    AdaptiveThreshold controller(1000, 20);
+    controller.Update(1050);
+    controller.Update(950);
+    ok = Check(controller.Threshold() == 20, "threshold holds inside the dead band") && ok;
+  }
+  {
+    AdaptiveThreshold controller(1000, 20);
+    controller.Update(2000);
+    ok = Check(controller.Threshold() > 20, "threshold rises on too many keypoints") && ok;
+  }
+  {
+    AdaptiveThreshold controller(1000, 20);
+    controller.Update(500);
+    ok = Check(controller.Threshold() < 20, "threshold drops on too few keypoints") && ok;
+  }
+  {
+    AdaptiveThreshold controller(1000, 20, 5, 120);
+    for (int i = 0; i < 100; i++) {
+      controller.Update(1000000);
+    }
+    ok = Check(controller.Threshold() == 120, "threshold clamps at the maximum") && ok;
+    for (int i = 0; i < 100; i++) {
+      controller.Update(0);
+    }
+    ok = Check(controller.Threshold() == 5, "threshold clamps at the minimum") && ok;
+  }
+  {
+    // FAST responses fall off about exponentially with the threshold
+    AdaptiveThreshold controller(1000, 20);
+    size_t keypoint_count = 0;
+    for (int frame = 0; frame < 30; frame++) {
+      keypoint_count = static_cast<size_t>(20000.0 * std::exp(-controller.Threshold() / 10.0));
+      controller.Update(keypoint_count);
+    }
+    ok = Check(InDeadBand(keypoint_count, 1000), "threshold settles on an exponential model") && ok;
+  }
+
+  // Histogram mode
+  {
+    AdaptiveCandidateTarget controller(1000);
+    int initial = controller.CandidateTarget();
+    controller.Update(1050);
+    controller.Update(950);
+    ok = Check(controller.CandidateTarget() == initial, "candidate target holds inside the dead band") && ok;
+    controller.Update(2000);
+    ok = Check(controller.CandidateTarget() < initial, "candidate target drops on too many keypoints") && ok;
+  }
+  {
+    AdaptiveCandidateTarget controller(1000);
+    for (int i = 0; i < 100; i++) {
+      controller.Update(0);
+    }
+    ok = Check(controller.CandidateTarget() == 16000, "candidate target clamps at 16x the target") && ok;
+    for (int i = 0; i < 100; i++) {
+      controller.Update(1000000);
+    }
+    ok = Check(controller.CandidateTarget() == 250, "candidate target clamps at a quarter of the target") && ok;
+  }
+  {
+    // NMS keeps a fixed fraction of the candidates
+    AdaptiveCandidateTarget controller(1000);
+    size_t keypoint_count = 0;
+    for (int frame = 0; frame < 30; frame++) {
+      keypoint_count = static_cast<size_t>(0.4 * controller.CandidateTarget());
+      controller.Update(keypoint_count);
+    }
+    ok = Check(InDeadBand(keypoint_count, 1000), "candidate target settles on a linear model") && ok;
+  }
+
+  std::cout << (ok ? "all controller checks passed" : "controller checks failed") << std::endl;
+  return ok ? 0 : 1;
+}
+
+// Uniform noise in [low, high), optionally blurred. Blur and contrast change
+// both how many FAST responses there are and how many survive NMS.
+struct Texture {
+  const char* name;
+  int low;
+  int high;
+  double blur_sigma;
+};
+
+const Texture kTextures[] = {
+    {"noise", 0, 256, 0.0},
+    {"blurred_noise", 0, 256, 1.0},
+    {"smooth_noise", 0, 256, 2.0},
+    {"low_contrast_noise", 96, 161, 0.0},
+};
+
+cv::Mat MakeTexture(int width, int height, const Texture& texture, uint64_t seed) {
+  cv::Mat image(height, width, CV_8UC1);
+  cv::RNG rng(seed);
+  rng.fill(image, cv::RNG::UNIFORM, texture.low, texture.high);
+  if (texture.blur_sigma > 0) {
+    cv::GaussianBlur(image, image, cv::Size(0, 0), texture.blur_sigma);
+  }
+  return image;
+}
+
+// One controller over a stream whose texture changes every kFramesPerTexture
+// frames, the count has to be back in the dead band after kSettleFrames.
+int RunOpenCL(const std::string& program_source_file) {
+  if (!HasOpenCLCPUDevice()) {
+    std::cout << "No OpenCL CPU device, skipping" << std::endl;
+    return kSkipReturnCode;
+  }
+
+  OpenCL::OpenCLHelper opencl_helper(OpenCL::OpenCLDeviceType::CPU);
+  auto program = opencl_helper.BuildProgramFromSourceFile(program_source_file);
+  AdaptiveCandidateTarget controller(kTargetKeypoints);
+  bool ok = true;
+
+  uint64_t seed = 1;
+  for (const Texture& texture : kTextures) {
+    cv::Mat image = MakeTexture(640, 480, texture, seed++);
+    for (int frame = 0; frame < kFramesPerTexture; frame++) {
+      std::vector<cv::KeyPoint> keypoints;
+      opencl_helper.FASTAdaptive(program, image, &controller, &keypoints);
+      if (frame >= kSettleFrames && !InDeadBand(keypoints.size(), kTargetKeypoints)) {
+        std::cerr << texture.name << " frame " << frame << " : " << keypoints.size()
+                  << " keypoints, target " << kTargetKeypoints << std::endl;
+        ok = false;
+      }
+      if (frame == kFramesPerTexture - 1) {
+        std::cout << texture.name << " : " << keypoints.size() << " keypoints, candidate target "
+                  << controller.CandidateTarget() << std::endl;
+      }
+    }
+  }
+  clReleaseProgram(program);
+
+  return ok ? 0 : 1;
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string mode = argc > 1 ? argv[1] : "";
+  if (mode == "unit") {
+    return RunUnit();
+  }
+  if (mode == "opencl" && argc > 2) {
+    return RunOpenCL(argv[2]);
+  }
+  std::cout << "Usage: " << argv[0] << " unit | opencl path/to/fast.cl" << std::endl;
+  return 1;
+}
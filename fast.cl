@@ -119,7 +119,135 @@ __kernel void FASTCorner(read_only image2d_t image, __global uchar* output_image
     output_image[index] = (max_score > threshold) ? max_score : 0;
 }
 
-__kernel void NonMaximumSuppression(__global uchar* image, __global uchar* output_image, int radius) {
+// Circle offsets shared by the buffer based kernels, same order as FASTCorner.
+__constant int FAST_CIRCLE_X[16] = {0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+__constant int FAST_CIRCLE_Y[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3};
+
+// Scalar FASTCorner score on a row-major buffer, used for the columns the
+// vector path cannot cover.
+uchar FASTScoreBuffer(__global const uchar* image, int width, int height, int x, int y, int threshold) {
+    if(x < 3 || y < 3 || x >= width - 3 || y >= height - 3) {
+        return 0;
+    }
+
+    int center_val = image[y * width + x];
+    int circle[16];
+    for(int i = 0; i < 16; i++) {
+        circle[i] = image[(y + FAST_CIRCLE_Y[i]) * width + x + FAST_CIRCLE_X[i]];
+    }
+
+    int max_score = 0;
+    for(int i = 0; i < 16; i++) {
+        int min_val = 255;
+        int max_val = 0;
+        for(int j = 0; j < 9; j++) {
+            min_val = min(min_val, circle[(i + j) & 15]);
+            max_val = max(max_val, circle[(i + j) & 15]);
+        }
+        max_score = max(max_score, max(min_val - center_val, center_val - max_val));
+    }
+
+    return (max_score > threshold) ? max_score : 0;
+}
+
+// Number of horizontally adjacent pixels handled by one FASTCornerBuffer work item,
+// chosen at program build time with -D FAST_VECTOR_WIDTH=4|8|16.
+#ifndef FAST_VECTOR_WIDTH
+#define FAST_VECTOR_WIDTH 16
+#endif
+
+#define FAST_CAT_(a, b) a##b
+#define FAST_CAT(a, b) FAST_CAT_(a, b)
+#define ucharV FAST_CAT(uchar, FAST_VECTOR_WIDTH)
+#define shortV FAST_CAT(short, FAST_VECTOR_WIDTH)
+#define ushortV FAST_CAT(ushort, FAST_VECTOR_WIDTH)
+#define uintV FAST_CAT(uint, FAST_VECTOR_WIDTH)
+#define vloadV FAST_CAT(vload, FAST_VECTOR_WIDTH)
+#define vstoreV FAST_CAT(vstore, FAST_VECTOR_WIDTH)
+#define convert_shortV FAST_CAT(convert_short, FAST_VECTOR_WIDTH)
+#define convert_ucharV FAST_CAT(convert_uchar, FAST_VECTOR_WIDTH)
+#define convert_uintV FAST_CAT(convert_uint, FAST_VECTOR_WIDTH)
+
+// Same output as FASTCorner, but reads a plain buffer and scores FAST_VECTOR_WIDTH
+// pixels per work item. Launch with global size (ceil(width / FAST_VECTOR_WIDTH), height).
+__kernel void FASTCornerBuffer(__global const uchar* image, __global uchar* output_image,
+                               int width, int height, int threshold) {
+    int x0 = get_global_id(0) * FAST_VECTOR_WIDTH;
+    int y = get_global_id(1);
+    if(x0 >= width) {
+        return;
+    }
+
+    __global uchar* output_row = output_image + y * width + x0;
+
+    // Border columns and the ragged right edge fall back to the scalar score
+    if(y < 3 || y >= height - 3 || x0 < 3 || x0 + FAST_VECTOR_WIDTH > width - 3) {
+        for(int i = 0; i < FAST_VECTOR_WIDTH && x0 + i < width; i++) {
+            output_row[i] = FASTScoreBuffer(image, width, height, x0 + i, y, threshold);
+        }
+        return;
+    }
+
+    __global const uchar* row = image + y * width + x0;
+    shortV center = convert_shortV(vloadV(0, row));
+
+    shortV circle[16];
+    #pragma unroll
+    for(int i = 0; i < 16; i++) {
+        circle[i] = convert_shortV(vloadV(0, row + FAST_CIRCLE_Y[i] * width + FAST_CIRCLE_X[i]));
+    }
+
+    // Arc test on 16-bit masks: bit i is set when circle pixel i is brighter
+    // (darker) than center by more than threshold. A pixel can only score above
+    // threshold if one of the masks holds 9 contiguous bits.
+    shortV upper = center + (shortV)threshold;
+    shortV lower = center - (shortV)threshold;
+    ushortV bright = 0;
+    ushortV dark = 0;
+    #pragma unroll
+    for(int i = 0; i < 16; i++) {
+        bright |= select((ushortV)0, (ushortV)(1 << i), circle[i] > upper);
+        dark |= select((ushortV)0, (ushortV)(1 << i), circle[i] < lower);
+    }
+
+    uintV bright_ring = convert_uintV(bright);
+    uintV dark_ring = convert_uintV(dark);
+    bright_ring |= bright_ring << 16;
+    dark_ring |= dark_ring << 16;
+
+    uintV bright_arc = bright_ring;
+    uintV dark_arc = dark_ring;
+    #pragma unroll
+    for(int j = 1; j < 9; j++) {
+        bright_arc &= bright_ring >> j;
+        dark_arc &= dark_ring >> j;
+    }
+
+    if(!any(((bright_arc | dark_arc) & (uintV)0xFFFF) != (uintV)0)) {
+        vstoreV((ucharV)0, 0, output_row);
+        return;
+    }
+
+    shortV max_score = 0;
+    #pragma unroll
+    for(int i = 0; i < 16; i++) {
+        shortV min_val = circle[i];
+        shortV max_val = circle[i];
+        #pragma unroll
+        for(int j = 1; j < 9; j++) {
+            min_val = min(min_val, circle[(i + j) & 15]);
+            max_val = max(max_val, circle[(i + j) & 15]);
+        }
+        max_score = max(max_score, max(min_val - center, center - max_val));
+    }
+
+    shortV score = select((shortV)0, max_score, max_score > (shortV)threshold);
+    vstoreV(convert_ucharV(score), 0, output_row);
+}
+
+// image is only read: neighbouring work items compare against it, so writing
+// suppressed pixels back would make the result depend on execution order.
+__kernel void NonMaximumSuppression(__global const uchar* image, __global uchar* output_image, int radius) {
     int2 pos = (int2)(get_global_id(0), get_global_id(1));
     int width = get_global_size(0);
     int height = get_global_size(1);
@@ -130,7 +258,6 @@ __kernel void NonMaximumSuppression(__global uchar* image, __global uchar* outpu
        pos.x >= width-radius || 
        pos.y >= height-radius) {
         output_image[index] = 0;
-        image[index] = 0;
         return;
     }
 
@@ -139,7 +266,6 @@ __kernel void NonMaximumSuppression(__global uchar* image, __global uchar* outpu
     // If center pixel is not a corner, skip
     if(center_val == 0) {
         output_image[index] = 0;
-        image[index] = 0;
         return;
     }
 
@@ -154,7 +280,6 @@ __kernel void NonMaximumSuppression(__global uchar* image, __global uchar* outpu
             
             if(neighbor_val > center_val) {
                 output_image[index] = 0;
-                image[index] = 0;
                 return;
             }
         }
@@ -164,3 +289,226 @@ __kernel void NonMaximumSuppression(__global uchar* image, __global uchar* outpu
     output_image[index] = center_val;
 }   
 
+
+// Per grid cell histogram of FASTCorner scores. histogram holds 256 bins per
+// cell and must be zeroed before launch.
+__kernel void ScoreHistogram(__global const uchar* score_image, __global uint* histogram,
+                             int cell_size, int cells_x) {
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    int index = pos.y * get_global_size(0) + pos.x;
+
+    uchar score = score_image[index];
+    if(score == 0) {
+        return;
+    }
+
+    int cell = (pos.y / cell_size) * cells_x + pos.x / cell_size;
+    atomic_inc(&histogram[cell * 256 + score]);
+}
+
+// One work item per cell: the highest threshold that still keeps at least the
+// cell's share of candidate_target responses, never below min_threshold.
+// Responses tied at the cutoff score are all kept, so a cell can end up above
+// its share; a cell with fewer responses keeps everything. The total is split
+// exactly, so small targets are not rounded up per cell.
+__kernel void SelectCellThreshold(__global const uint* histogram, __global uchar* cell_thresholds,
+                                  int candidate_target, int min_threshold) {
+    int cell = get_global_id(0);
+    int cell_count = get_global_size(0);
+    __global const uint* cell_histogram = histogram + cell * 256;
+
+    long total = candidate_target;
+    int cell_target = (int)(total * (cell + 1) / cell_count - total * cell / cell_count);
+
+    int threshold = min_threshold;
+    uint count = 0;
+    for(int score = 255; score > min_threshold; score--) {
+        count += cell_histogram[score];
+        if(count >= (uint)cell_target) {
+            threshold = score - 1;
+            break;
+        }
+    }
+
+    cell_thresholds[cell] = (uchar)max(threshold, min_threshold);
+}
+
+// Zero the scores that do not exceed their cell threshold, in place.
+__kernel void ApplyCellThreshold(__global uchar* score_image, __global const uchar* cell_thresholds,
+                                 int cell_size, int cells_x) {
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    int index = pos.y * get_global_size(0) + pos.x;
+
+    int cell = (pos.y / cell_size) * cells_x + pos.x / cell_size;
+    if(score_image[index] <= cell_thresholds[cell]) {
+        score_image[index] = 0;
+    }
+}
+
+// One work item: the score threshold that keeps at most max_keypoints of the
+// responses counted in histogram (one 256 bin cell). Responses tied at the
+// cutoff score are dropped together. Feed the result to ApplyCellThreshold.
+__kernel void SelectScoreCutoff(__global const uint* histogram, __global uchar* cutoff,
+                                int max_keypoints) {
+    uint kept = 0;
+    int threshold = 0;
+    for(int score = 255; score > 0; score--) {
+        if(kept + histogram[score] > (uint)max_keypoints) {
+            threshold = score;
+            break;
+        }
+        kept += histogram[score];
+    }
+    cutoff[0] = (uchar)threshold;
+}
+
+// OpenCL 1.1 has no clEnqueueFillBuffer, one work item per element
+__kernel void ZeroBuffer(__global uint* data) {
+    data[get_global_id(0)] = 0;
+}
+
+// Shared with the host, OpenCLHelper passes them as build options from the
+// constants in opencl_helper.h
+#if !defined(ORB_HALF_PATCH_SIZE) || !defined(ORB_DESCRIPTOR_BYTES)
+#error "ORB_HALF_PATCH_SIZE and ORB_DESCRIPTOR_BYTES must be defined at build time"
+#endif
+
+// Gather the surviving NMS responses into a dense keypoint list. Keypoints
+// closer than border to the image edge are dropped. keypoint_count must be
+// zeroed before launch and may end up larger than max_keypoints.
+__kernel void CompactKeypoints(__global const uchar* nms_image, __global int* keypoint_count,
+                               __global int2* keypoints, __global uchar* keypoint_scores,
+                               int max_keypoints, int border) {
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    int width = get_global_size(0);
+    int height = get_global_size(1);
+
+    if(pos.x < border || pos.y < border ||
+       pos.x >= width - border || pos.y >= height - border) {
+        return;
+    }
+
+    uchar score = nms_image[pos.y * width + pos.x];
+    if(score == 0) {
+        return;
+    }
+
+    int slot = atomic_inc(keypoint_count);
+    if(slot < max_keypoints) {
+        keypoints[slot] = pos;
+        keypoint_scores[slot] = score;
+    }
+}
+
+// cv::BORDER_REFLECT_101 index, the border mode cv::ORB pads its images with
+int Reflect101(int i, int n) {
+    i = i < 0 ? -i : i;
+    return i >= n ? 2 * n - 2 - i : i;
+}
+
+// 7x7 Gaussian with sigma 2 as in cv::ORB, which samples its BRIEF tests on a
+// blurred image. Rows first and then columns, in float, so the result matches
+// OpenCV's separable filter.
+__kernel void ORBBlur(read_only image2d_t image, __global uchar* output_image) {
+    const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+    // cv::getGaussianKernel(7, 2)
+    const float weight[7] = {7.015932351e-02f, 1.310748756e-01f, 1.907128245e-01f, 2.161059380e-01f,
+                             1.907128245e-01f, 1.310748756e-01f, 7.015932351e-02f};
+
+    int2 pos = (int2)(get_global_id(0), get_global_id(1));
+    int width = get_global_size(0);
+    int height = get_global_size(1);
+
+    float sum = 0.0f;
+    for(int dy = -3; dy <= 3; dy++) {
+        int y = Reflect101(pos.y + dy, height);
+        float row = 0.0f;
+        for(int dx = -3; dx <= 3; dx++) {
+            uint4 pixel = read_imageui(image, sampler, (int2)(Reflect101(pos.x + dx, width), y));
+            row += weight[dx + 3] * (float)pixel.x;
+        }
+        sum += weight[dy + 3] * row;
+    }
+
+    output_image[pos.y * width + pos.x] = convert_uchar_sat_rte(sum);
+}
+
+// One keypoint as DetectAndDescribe reads it back, see OpenCL::ORBKeypointRecord
+typedef struct {
+    int x;
+    int y;
+    float angle;
+    int score;
+} ORBKeypoint;
+
+// Intensity centroid orientation over cv::ORB's circular patch, umax[dy] being
+// the half width of row dy. One work item per keypoint slot, launch with
+// max_keypoints work items after CompactKeypoints. angle is in radians, as
+// returned by atan2.
+__kernel void ORBOrientation(read_only image2d_t image, __constant int* umax,
+                             __global const int* keypoint_count, int max_keypoints,
+                             __global const int2* keypoints, __global const uchar* keypoint_scores,
+                             __global ORBKeypoint* records) {
+    const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+    int i = get_global_id(0);
+    if(i >= min(*keypoint_count, max_keypoints)) {
+        return;
+    }
+    int2 kp = keypoints[i];
+
+    int m_01 = 0;
+    int m_10 = 0;
+
+    for(int dy = -ORB_HALF_PATCH_SIZE; dy <= ORB_HALF_PATCH_SIZE; dy++) {
+        int dx_max = umax[abs(dy)];
+        for(int dx = -dx_max; dx <= dx_max; dx++) {
+            uint4 pixel = read_imageui(image, sampler, (int2)(kp.x + dx, kp.y + dy));
+            m_10 += dx * (int)pixel.x;
+            m_01 += dy * (int)pixel.x;
+        }
+    }
+
+    ORBKeypoint record;
+    record.x = kp.x;
+    record.y = kp.y;
+    record.angle = atan2((float)m_01, (float)m_10);
+    record.score = keypoint_scores[i];
+    records[i] = record;
+}
+
+// rBRIEF: cv::ORB's 256 learned test pairs in pattern (x1, y1, x2, y2) are
+// rotated by the keypoint angle and compared on the blurred image, 8 tests
+// packed per output byte in the same bit order as cv::ORB. Launch like
+// ORBOrientation.
+__kernel void ORBDescriptor(__global const uchar* blurred_image, int width, int height,
+                            __global const int* keypoint_count, int max_keypoints,
+                            __global const ORBKeypoint* records,
+                            __constant char4* pattern, __global uchar* descriptors) {
+    int i = get_global_id(0);
+    if(i >= min(*keypoint_count, max_keypoints)) {
+        return;
+    }
+    ORBKeypoint kp = records[i];
+
+    float cos_angle;
+    float sin_angle = sincos(kp.angle, &cos_angle);
+
+    for(int b = 0; b < ORB_DESCRIPTOR_BYTES; b++) {
+        uchar value = 0;
+        for(int k = 0; k < 8; k++) {
+            char4 test = pattern[b * 8 + k];
+
+            // rint rounds half to even like cvRound
+            int x1 = Reflect101(kp.x + (int)rint(test.x * cos_angle - test.y * sin_angle), width);
+            int y1 = Reflect101(kp.y + (int)rint(test.x * sin_angle + test.y * cos_angle), height);
+            int x2 = Reflect101(kp.x + (int)rint(test.z * cos_angle - test.w * sin_angle), width);
+            int y2 = Reflect101(kp.y + (int)rint(test.z * sin_angle + test.w * cos_angle), height);
+
+            if(blurred_image[y1 * width + x1] < blurred_image[y2 * width + x2]) {
+                value |= (uchar)(1 << k);
+            }
+        }
+        descriptors[i * ORB_DESCRIPTOR_BYTES + b] = value;
+    }
+}
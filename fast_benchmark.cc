@@ -0,0 +1,79 @@
+#include "opencv2/opencv.hpp"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "opencl_helper.h"
+
+// Times the FASTCorner (image2d) kernel against the FASTCornerBuffer variants on
+// one device and checks that every variant produces the same score map.
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " path/to/image [cpu|gpu] [iterations] [path/to/fast.cl]" << std::endl;
+    return 1;
+  }
+  OpenCL::OpenCLDeviceType device_type = OpenCL::OpenCLDeviceType::CPU;
+  if (argc > 2 && std::string(argv[2]) == "gpu") {
+    device_type = OpenCL::OpenCLDeviceType::GPU;
+  }
+  int iterations = argc > 3 ? std::stoi(argv[3]) : 100;
+  std::string program_source_file = argc > 4 ? argv[4] : "../fast.cl";
+
+  cv::Mat img = cv::imread(argv[1], cv::IMREAD_GRAYSCALE);
+  if (img.empty()) {
+    std::cerr << "Can't read image : " << argv[1] << std::endl;
+    return 1;
+  }
+  size_t image_width = img.cols;
+  size_t image_height = img.rows;
+  const int threshold = 10;
+
+  OpenCL::OpenCLHelper opencl_helper(device_type);
+
+  cl_mem corner_buffer = opencl_helper.CreateBufferReadWrite(image_width * image_height);
+
+  cv::Mat reference;
+  bool all_match = true;
+  for (const OpenCL::FASTKernelVariantInfo& info : OpenCL::FAST_KERNEL_VARIANTS) {
+    OpenCL::FASTKernelVariant variant = info.variant;
+    auto program = opencl_helper.BuildProgramFromSourceFile(
+        program_source_file, OpenCL::FASTBuildOptions(variant));
+    cl_mem input = opencl_helper.CreateFASTInput(variant, image_width, image_height, img.data);
+    cl_kernel kernel = opencl_helper.CreateFASTKernel(program, variant);
+
+    // Warm up once so program compilation on lazy runtimes is not timed
+    opencl_helper.RunFAST(kernel, variant, input, corner_buffer, image_width, image_height, threshold);
+    opencl_helper.Finish();
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++) {
+      opencl_helper.RunFAST(kernel, variant, input, corner_buffer, image_width, image_height, threshold);
+    }
+    opencl_helper.Finish();
+    auto end_time = std::chrono::high_resolution_clock::now();
+
+    double total_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+    double mean_ms = total_ms / iterations;
+    double mpixel_per_s = image_width * image_height / (mean_ms * 1e3);
+
+    cv::Mat scores(image_height, image_width, CV_8UC1);
+    opencl_helper.CopyToHost(corner_buffer, scores.data, image_width * image_height);
+    int mismatches = 0;
+    if (reference.empty()) {
+      reference = scores;
+    } else {
+      mismatches = cv::countNonZero(reference != scores);
+      all_match = all_match && mismatches == 0;
+    }
+
+    std::cout << info.name << " : " << mean_ms << " ms, " << mpixel_per_s
+              << " MPixel/s, mismatches " << mismatches << std::endl;
+
+    clReleaseKernel(kernel);
+    clReleaseMemObject(input);
+    clReleaseProgram(program);
+  }
+
+  clReleaseMemObject(corner_buffer);
+  return all_match ? 0 : 1;
+}
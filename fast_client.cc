@@ -0,0 +1,44 @@
+#include "opencv2/opencv.hpp"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "fast_service.h"
+
+// Submits an image to a running `fast --daemon=<socket>` and prints the result.
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: " << argv[0] << " path/to/socket path/to/image [threshold] [repeat]" << std::endl;
+    return 1;
+  }
+  int threshold = argc > 3 ? std::stoi(argv[3]) : 10;
+  int repeat = argc > 4 ? std::stoi(argv[4]) : 1;
+
+  cv::Mat image_gray = cv::imread(argv[2], cv::IMREAD_GRAYSCALE);
+  if (image_gray.empty()) {
+    std::cerr << "Can't read image : " << argv[2] << std::endl;
+    return 1;
+  }
+
+  FastService::FastClient client;
+  if (!client.Connect(argv[1])) {
+    std::cerr << "Can't connect to " << argv[1] << std::endl;
+    return 1;
+  }
+
+  std::vector<FastService::PackedKeypoint> keypoints;
+  auto start_time = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < repeat; i++) {
+    if (!client.Detect(image_gray, threshold, &keypoints)) {
+      std::cerr << "Request failed" << std::endl;
+      return 1;
+    }
+  }
+  auto end_time = std::chrono::high_resolution_clock::now();
+  double mean_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count() / repeat;
+
+  std::cout << "Daemon Detect : " << keypoints.size() << std::endl;
+  std::cout << "Daemon Request Latency: " << mean_ms << " ms" << std::endl;
+  return 0;
+}
@@ -0,0 +1,418 @@
+#include "fast_daemon.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fast_service.h"
+#include "trace.h"
+
+namespace {
+
+const size_t kMaxBatchSize = 8;
+const int kMaxKeypoints = 1 << 16;
+const int kNMSRadius = 3;
+#ifdef OPENCLFAST_TRACING
+const char kDaemonTraceFile[] = "fast_daemon_trace.json";
+#endif
+
+struct JobResult {
+  int32_t status = FastService::Status::Ok;
+  std::vector<FastService::PackedKeypoint> keypoints;
+};
+
+// One request in flight. Owned by the connection thread, which blocks on the
+// future until the device thread has filled in the result.
+struct Job {
+  FastService::Request request;
+  // The client's memfd, or -1. The connection thread closes it.
+  int memory_fd = -1;
+  std::promise<JobResult> result;
+};
+
+class JobQueue {
+public:
+  void Push(Job* job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(job);
+    }
+    cv_.notify_one();
+  }
+
+  // Blocks until at least one job is queued, then takes up to max_jobs of them
+  std::vector<Job*> PopBatch(size_t max_jobs) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return !jobs_.empty(); });
+    size_t n = std::min(max_jobs, jobs_.size());
+    std::vector<Job*> batch(jobs_.begin(), jobs_.begin() + n);
+    jobs_.erase(jobs_.begin(), jobs_.begin() + n);
+    return batch;
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job*> jobs_;
+};
+
+struct MappedFrame {
+  void* data = nullptr;
+  size_t size = 0;
+};
+
+bool ValidRequest(const FastService::Request& request) {
+  return request.magic == FastService::kRequestMagic &&
+         request.width > 0 && request.width <= FastService::kMaxImageSide &&
+         request.height > 0 && request.height <= FastService::kMaxImageSide &&
+         request.threshold >= 0 && request.threshold < 256;
+}
+
+// The image has to fit in one OpenCL image and each score map in one buffer
+bool FitsDevice(const FastService::Request& request, const OpenCL::DeviceLimits& limits) {
+  return request.width <= limits.image2d_max_width &&
+         request.height <= limits.image2d_max_height &&
+         static_cast<cl_ulong>(request.width) * request.height <= limits.max_mem_alloc_size;
+}
+
+// Maps the client's memfd read only. The F_SEAL_SHRINK check is what makes
+// the size check stick: an unsealed file could be truncated between fstat and
+// the device read and the read would fault with SIGBUS. Files that can't carry
+// seals fail F_GET_SEALS, as does a missing descriptor (-1).
+bool MapFrame(const FastService::Request& request, int memory_fd, MappedFrame* frame) {
+  size_t size = static_cast<size_t>(request.width) * request.height;
+  int seals = fcntl(memory_fd, F_GET_SEALS);
+  if (seals < 0 || (seals & F_SEAL_SHRINK) == 0) {
+    return false;
+  }
+  struct stat memory_stat;
+  if (fstat(memory_fd, &memory_stat) != 0 || static_cast<size_t>(memory_stat.st_size) < size) {
+    return false;
+  }
+  void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, memory_fd, 0);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  frame->data = data;
+  frame->size = size;
+  return true;
+}
+
+void UnmapFrame(MappedFrame* frame) {
+  if (frame->data) {
+    munmap(frame->data, frame->size);
+  }
+  *frame = MappedFrame();
+}
+
+// Device buffers for one position in a batch. They live as long as the daemon
+// and the image sized ones are only reallocated when the frame size changes.
+struct DeviceSlot {
+  size_t width = 0;
+  size_t height = 0;
+  cl_mem image = nullptr;
+  cl_mem corner = nullptr;
+  cl_mem nms = nullptr;
+  cl_mem count = nullptr;
+  cl_mem keypoints = nullptr;
+  cl_mem scores = nullptr;
+};
+
+class FastDaemon {
+public:
+  FastDaemon(OpenCL::OpenCLDeviceType device_type, const std::string& program_source_file)
+      : opencl_helper_(device_type), slots_(kMaxBatchSize) {
+    program_ = opencl_helper_.BuildProgramFromSourceFile(program_source_file);
+    fast_kernel_ = opencl_helper_.CreateKernel(program_, "FASTCorner");
+    nms_kernel_ = opencl_helper_.CreateKernel(program_, "NonMaximumSuppression");
+    compact_kernel_ = opencl_helper_.CreateKernel(program_, "CompactKeypoints");
+
+    limits_ = opencl_helper_.GetDeviceLimits();
+    std::cout << "Largest frame " << limits_.image2d_max_width << " x "
+              << limits_.image2d_max_height << ", " << limits_.max_mem_alloc_size
+              << " bytes per buffer" << std::endl;
+
+    // From here on a failing request must not take the daemon down
+    opencl_helper_.SetExitOnError(false);
+  }
+
+  void DeviceLoop(JobQueue* queue) {
+    TRACE_THREAD_NAME("device");
+    while (true) {
+      std::vector<Job*> batch = queue->PopBatch(kMaxBatchSize);
+      ProcessBatch(batch);
+    }
+  }
+
+private:
+  // Returns false if the device could not allocate the buffers. The slot is
+  // then left empty and allocated again by the next request that uses it.
+  bool EnsureSlot(DeviceSlot* slot, size_t width, size_t height) {
+    if (slot->count == nullptr) {
+      slot->count = opencl_helper_.CreateBufferReadWrite(sizeof(cl_int));
+      slot->keypoints = opencl_helper_.CreateBufferReadWrite(kMaxKeypoints * sizeof(cl_int2));
+      slot->scores = opencl_helper_.CreateBufferReadWrite(kMaxKeypoints);
+    }
+    if (slot->width != width || slot->height != height) {
+      for (cl_mem* buffer : {&slot->image, &slot->corner, &slot->nms}) {
+        if (*buffer != nullptr) {
+          clReleaseMemObject(*buffer);
+          *buffer = nullptr;
+        }
+      }
+      slot->image = opencl_helper_.CreateOpenCLImage2D(width, height,
+                                                       OpenCL::ImageFormat::GrayUInt8, nullptr);
+      slot->corner = opencl_helper_.CreateBufferReadWrite(width * height);
+      slot->nms = opencl_helper_.CreateBufferReadWrite(width * height);
+      slot->width = width;
+      slot->height = height;
+    }
+    if (opencl_helper_.TakeError() != CL_SUCCESS) {
+      ReleaseSlot(slot);
+      return false;
+    }
+    return true;
+  }
+
+  // Commands still queued on the buffers keep them alive until they finish
+  void ReleaseSlot(DeviceSlot* slot) {
+    for (cl_mem buffer : {slot->image, slot->corner, slot->nms, slot->count, slot->keypoints,
+                          slot->scores}) {
+      if (buffer != nullptr) {
+        clReleaseMemObject(buffer);
+      }
+    }
+    *slot = DeviceSlot();
+  }
+
+  // Everything for the whole batch is enqueued before the first wait, so the
+  // device sees one stream of work and the host syncs twice per batch: once
+  // for the keypoint counts and once for the keypoint lists. OpenCL errors are
+  // collected per request and answered with Status::DeviceError.
+  void ProcessBatch(const std::vector<Job*>& batch) {
+    TRACE_SCOPE("batch");
+    TRACE_COUNTER("batch_size", batch.size());
+    static const cl_int zero = 0;
+    std::vector<JobResult> results(batch.size());
+    std::vector<MappedFrame> frames(batch.size());
+    std::vector<cl_int> counts(batch.size(), 0);
+
+    for (size_t i = 0; i < batch.size(); i++) {
+      const FastService::Request& request = batch[i]->request;
+      if (!ValidRequest(request)) {
+        results[i].status = FastService::Status::BadRequest;
+        continue;
+      }
+      if (!FitsDevice(request, limits_)) {
+        results[i].status = FastService::Status::ImageTooLarge;
+        continue;
+      }
+      if (!MapFrame(request, batch[i]->memory_fd, &frames[i])) {
+        results[i].status = FastService::Status::SharedMemoryError;
+        continue;
+      }
+
+      size_t width = request.width;
+      size_t height = request.height;
+      DeviceSlot& slot = slots_[i];
+      if (!EnsureSlot(&slot, width, height)) {
+        results[i].status = FastService::Status::DeviceError;
+        continue;
+      }
+
+      opencl_helper_.CopyImage2DFromHostAsync(slot.image, width, height, frames[i].data);
+      opencl_helper_.CopyFromHostAsync(slot.count, &zero, sizeof(zero));
+
+      opencl_helper_.KernelBindArgs(fast_kernel_, slot.image, slot.corner,
+                                    static_cast<int>(request.threshold));
+      opencl_helper_.KernelRun(fast_kernel_, width, height, 1);
+
+      opencl_helper_.KernelBindArgs(nms_kernel_, slot.corner, slot.nms, kNMSRadius);
+      opencl_helper_.KernelRun(nms_kernel_, width, height, 1);
+
+      opencl_helper_.KernelBindArgs(compact_kernel_, slot.nms, slot.count, slot.keypoints,
+                                    slot.scores, kMaxKeypoints, kNMSRadius);
+      opencl_helper_.KernelRun(compact_kernel_, width, height, 1);
+
+      opencl_helper_.CopyToHostAsync(slot.count, &counts[i], sizeof(cl_int));
+
+      if (opencl_helper_.TakeError() != CL_SUCCESS) {
+        results[i].status = FastService::Status::DeviceError;
+        ReleaseSlot(&slot);
+      }
+    }
+    opencl_helper_.Finish();
+    bool counts_failed = opencl_helper_.TakeError() != CL_SUCCESS;
+
+    std::vector<std::vector<cl_int2>> positions(batch.size());
+    std::vector<std::vector<uchar>> scores(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+      UnmapFrame(&frames[i]);
+      if (results[i].status == FastService::Status::Ok && counts_failed) {
+        results[i].status = FastService::Status::DeviceError;
+      }
+      size_t n = std::min(counts[i], kMaxKeypoints);
+      if (results[i].status != FastService::Status::Ok || n == 0) {
+        continue;
+      }
+      positions[i].resize(n);
+      scores[i].resize(n);
+      opencl_helper_.CopyToHostAsync(slots_[i].keypoints, positions[i].data(), n * sizeof(cl_int2));
+      opencl_helper_.CopyToHostAsync(slots_[i].scores, scores[i].data(), n);
+      if (opencl_helper_.TakeError() != CL_SUCCESS) {
+        results[i].status = FastService::Status::DeviceError;
+      }
+    }
+    opencl_helper_.Finish();
+    bool keypoints_failed = opencl_helper_.TakeError() != CL_SUCCESS;
+
+    for (size_t i = 0; i < batch.size(); i++) {
+      if (results[i].status == FastService::Status::Ok && keypoints_failed &&
+          !positions[i].empty()) {
+        results[i].status = FastService::Status::DeviceError;
+      }
+      if (results[i].status != FastService::Status::Ok) {
+        positions[i].clear();
+      }
+      results[i].keypoints.resize(positions[i].size());
+      for (size_t k = 0; k < positions[i].size(); k++) {
+        FastService::PackedKeypoint& packed = results[i].keypoints[k];
+        packed.x = static_cast<uint16_t>(positions[i][k].s[0]);
+        packed.y = static_cast<uint16_t>(positions[i][k].s[1]);
+        packed.score = scores[i][k];
+        packed.reserved = 0;
+      }
+      batch[i]->result.set_value(std::move(results[i]));
+    }
+  }
+
+  OpenCL::OpenCLHelper opencl_helper_;
+  cl_program program_;
+  cl_kernel fast_kernel_;
+  cl_kernel nms_kernel_;
+  cl_kernel compact_kernel_;
+  OpenCL::DeviceLimits limits_;
+  std::vector<DeviceSlot> slots_;
+};
+
+#ifdef OPENCLFAST_TRACING
+// SIGUSR1 is blocked in every thread, this one takes it synchronously so the
+// export runs outside signal context
+void TraceExportLoop() {
+  TRACE_THREAD_NAME("trace_export");
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  while (true) {
+    int signal_number = 0;
+    if (sigwait(&signals, &signal_number) == 0) {
+      bool written = TRACE_WRITE(kDaemonTraceFile);
+      std::cout << (written ? "Wrote " : "Failed to write ") << kDaemonTraceFile << std::endl;
+    }
+  }
+}
+#endif
+
+void ServeClient(int client_fd, JobQueue* queue) {
+  FastService::Request request;
+  int memory_fd = -1;
+  while (FastService::RecvRequest(client_fd, &request, &memory_fd)) {
+    Job job;
+    job.request = request;
+    job.memory_fd = memory_fd;
+    std::future<JobResult> future = job.result.get_future();
+    queue->Push(&job);
+    JobResult result = future.get();
+    if (memory_fd >= 0) {
+      close(memory_fd);
+    }
+
+    FastService::ResponseHeader header;
+    header.status = result.status;
+    header.keypoint_count = static_cast<uint32_t>(result.keypoints.size());
+    if (!FastService::SendAll(client_fd, &header, sizeof(header)) ||
+        !FastService::SendAll(client_fd, result.keypoints.data(),
+                              result.keypoints.size() * sizeof(FastService::PackedKeypoint))) {
+      break;
+    }
+  }
+  close(client_fd);
+}
+
+}
+
+int RunFastDaemon(const std::string& socket_path, const std::string& program_source_file,
+                  OpenCL::OpenCLDeviceType device_type) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Socket path too long : " << socket_path << std::endl;
+    return 1;
+  }
+  std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+#ifdef OPENCLFAST_TRACING
+  // Block SIGUSR1 before any thread starts, the OpenCL runtime's included, so
+  // every thread inherits the mask and only TraceExportLoop receives it
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  std::thread(TraceExportLoop).detach();
+#endif
+
+  // Pay for device discovery and the program build once, before accepting clients
+  static FastDaemon fast_daemon(device_type, program_source_file);
+  static JobQueue queue;
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    std::perror("socket");
+    return 1;
+  }
+  // Replace a socket left behind by an earlier run, but never anything else
+  struct stat path_stat;
+  if (lstat(socket_path.c_str(), &path_stat) == 0) {
+    if (!S_ISSOCK(path_stat.st_mode)) {
+      std::cerr << socket_path << " exists and is not a socket" << std::endl;
+      close(listen_fd);
+      return 1;
+    }
+    unlink(socket_path.c_str());
+  }
+  if (bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(listen_fd, SOMAXCONN) != 0) {
+    std::perror("bind");
+    close(listen_fd);
+    return 1;
+  }
+
+  std::thread(&FastDaemon::DeviceLoop, &fast_daemon, &queue).detach();
+  std::cout << "FAST daemon listening on " << socket_path << std::endl;
+
+  while (true) {
+    int client_fd = accept(listen_fd, nullptr, nullptr);
+    if (client_fd < 0) {
+      if (errno != EINTR) {
+        std::perror("accept");
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      continue;
+    }
+    std::thread(ServeClient, client_fd, &queue).detach();
+  }
+}
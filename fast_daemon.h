@@ -0,0 +1,16 @@
+#ifndef FAST_DAEMON_H
+#define FAST_DAEMON_H
+
+#include <string>
+#include "opencl_helper.h"
+
+// Serves FAST detection requests (protocol in fast_service.h) on a Unix-domain
+// socket. The OpenCL context, program and kernels are created once at startup
+// and shared by every client; requests that queue up while the device is busy
+// are submitted together as one batch. Only returns if the socket can't be set up.
+// Built with tracing, kill -USR1 <pid> writes fast_daemon_trace.json to the
+// working directory.
+int RunFastDaemon(const std::string& socket_path, const std::string& program_source_file,
+                  OpenCL::OpenCLDeviceType device_type = OpenCL::OpenCLDeviceType::GPU);
+
+#endif // FAST_DAEMON_H
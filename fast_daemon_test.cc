@@ -0,0 +1,333 @@
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fast_daemon.h"
+#include "fast_service.h"
+#include "fast_test_util.h"
+
+// Round trip through the FAST daemon: a daemon on the OpenCL CPU device in a
+// child process, several FastClient threads sending frames concurrently, and
+// every answer compared with RunOpenCLFAST on the same device.
+//
+//   fast_daemon_test path/to/fast.cl
+
+namespace {
+
+const int kClientThreads = 4;
+const int kRoundsPerThread = 3;
+const int kThresholds[] = {10, 20, 40};
+// CompactKeypoints in the daemon skips the NMS radius around the border
+const int kBorder = 3;
+// The daemon builds its program before listening, POCL can take a while
+const int kConnectAttempts = 600;
+
+typedef std::tuple<int, int, int> Keypoint;
+
+struct Case {
+  int frame;
+  int threshold;
+  std::vector<Keypoint> expected;
+};
+
+std::vector<cv::Mat> MakeFrames() {
+  std::vector<cv::Mat> frames;
+  frames.push_back(MakeSyntheticCorners(640, 480).image);
+  frames.push_back(MakeSyntheticCorners(333, 211, 150, 100).image);
+
+  cv::Mat noise(360, 500, CV_8UC1);
+  cv::RNG rng(7);
+  rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+  cv::GaussianBlur(noise, noise, cv::Size(0, 0), 1.0);
+  frames.push_back(noise);
+  return frames;
+}
+
+std::vector<Keypoint> ExpectedKeypoints(OpenCL::OpenCLHelper& opencl_helper, cl_program program,
+                                        const cv::Mat& image, int threshold) {
+  cv::Mat nms;
+  RunOpenCLFAST(opencl_helper, program, image, OpenCL::FASTKernelVariant::Image2D, threshold,
+                nullptr, &nms);
+  std::vector<Keypoint> keypoints;
+  for (int y = kBorder; y < image.rows - kBorder; y++) {
+    for (int x = kBorder; x < image.cols - kBorder; x++) {
+      int score = nms.at<uchar>(y, x);
+      if (score > 0) {
+        keypoints.push_back(Keypoint(x, y, score));
+      }
+    }
+  }
+  std::sort(keypoints.begin(), keypoints.end());
+  return keypoints;
+}
+
+std::vector<Keypoint> SortedKeypoints(const std::vector<FastService::PackedKeypoint>& packed) {
+  std::vector<Keypoint> keypoints;
+  for (const FastService::PackedKeypoint& kp : packed) {
+    keypoints.push_back(Keypoint(kp.x, kp.y, kp.score));
+  }
+  std::sort(keypoints.begin(), keypoints.end());
+  return keypoints;
+}
+
+// Sends one hand built request with memory_fd attached (-1 for none) on its own
+// connection, returns the status or -1
+int SendRawRequest(const std::string& socket_path, const FastService::Request& request,
+                   int memory_fd) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int status = -1;
+  FastService::ResponseHeader header;
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 &&
+      FastService::SendRequest(fd, request, memory_fd) &&
+      FastService::RecvAll(fd, &header, sizeof(header))) {
+    status = header.status;
+  }
+  close(fd);
+  return status;
+}
+
+FastService::Request ValidRequest() {
+  FastService::Request request = {};
+  request.magic = FastService::kRequestMagic;
+  request.width = 64;
+  request.height = 64;
+  request.threshold = 20;
+  return request;
+}
+
+// A memfd of size bytes, sealed against shrinking like FastClient's when sealed
+int MakeMemoryFd(size_t size, bool sealed) {
+  int fd = memfd_create("fast_daemon_test", MFD_CLOEXEC | (sealed ? MFD_ALLOW_SEALING : 0));
+  if (fd < 0 || ftruncate(fd, size) != 0 ||
+      (sealed && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0)) {
+    std::perror("memfd");
+  }
+  return fd;
+}
+
+// Connects once the daemon listens. Returns 0, or the code to exit with when
+// the daemon exited first or never came up.
+int WaitForDaemon(pid_t daemon, const std::string& socket_path) {
+  for (int attempt = 0; attempt < kConnectAttempts; attempt++) {
+    FastService::FastClient probe;
+    if (probe.Connect(socket_path)) {
+      return 0;
+    }
+    int status = 0;
+    if (waitpid(daemon, &status, WNOHANG) == daemon) {
+      bool skipped = WIFEXITED(status) && WEXITSTATUS(status) == kSkipReturnCode;
+      std::cerr << (skipped ? "Daemon found no OpenCL CPU device" : "Daemon exited early")
+                << std::endl;
+      return skipped ? kSkipReturnCode : 1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  std::cerr << "Daemon did not start listening on " << socket_path << std::endl;
+  kill(daemon, SIGKILL);
+  waitpid(daemon, nullptr, 0);
+  return 1;
+}
+
+bool RunClients(const std::string& socket_path, const std::vector<cv::Mat>& frames,
+                const std::vector<Case>& cases) {
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kClientThreads; t++) {
+    threads.emplace_back([&, t]() {
+      FastService::FastClient client;
+      if (!client.Connect(socket_path)) {
+        std::cerr << "client " << t << " could not connect" << std::endl;
+        failures++;
+        return;
+      }
+      // Each thread walks the cases from a different start, so one batch
+      // mixes frame sizes and thresholds
+      for (size_t i = 0; i < kRoundsPerThread * cases.size(); i++) {
+        const Case& c = cases[(i + t) % cases.size()];
+        std::vector<FastService::PackedKeypoint> packed;
+        if (!client.Detect(frames[c.frame], c.threshold, &packed)) {
+          std::cerr << "client " << t << " frame " << c.frame << " threshold " << c.threshold
+                    << " : request failed" << std::endl;
+          failures++;
+        } else if (SortedKeypoints(packed) != c.expected) {
+          std::cerr << "client " << t << " frame " << c.frame << " threshold " << c.threshold
+                    << " : " << packed.size() << " keypoints, expected " << c.expected.size()
+                    << std::endl;
+          failures++;
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  return failures == 0;
+}
+
+bool RunRejects(const std::string& socket_path, const std::string& directory) {
+  const size_t image_size = 64 * 64;
+  bool ok = true;
+
+  int sealed = MakeMemoryFd(image_size, true);
+  FastService::Request bad_magic = ValidRequest();
+  bad_magic.magic = 0;
+  ok = Check(SendRawRequest(socket_path, bad_magic, sealed) == FastService::Status::BadRequest,
+             "bad magic is rejected") && ok;
+  ok = Check(SendRawRequest(socket_path, ValidRequest(), sealed) == FastService::Status::Ok,
+             "a sealed memfd is accepted") && ok;
+  ok = Check(ftruncate(sealed, image_size / 2) != 0, "a sealed memfd can't shrink") && ok;
+  close(sealed);
+
+  ok = Check(SendRawRequest(socket_path, ValidRequest(), -1) ==
+                 FastService::Status::SharedMemoryError,
+             "requests without a memfd are rejected") && ok;
+
+  int unsealed = MakeMemoryFd(image_size, false);
+  ok = Check(SendRawRequest(socket_path, ValidRequest(), unsealed) ==
+                 FastService::Status::SharedMemoryError,
+             "unsealed memfds are rejected") && ok;
+  close(unsealed);
+
+  int small = MakeMemoryFd(image_size / 2, true);
+  ok = Check(SendRawRequest(socket_path, ValidRequest(), small) ==
+                 FastService::Status::SharedMemoryError,
+             "memfds smaller than the image are rejected") && ok;
+  close(small);
+
+  // A regular file can't carry seals, so it could be truncated under the daemon
+  std::string file_path = directory + "/regular_file";
+  int file = open(file_path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+  ok = Check(file >= 0 && ftruncate(file, image_size) == 0 &&
+                 SendRawRequest(socket_path, ValidRequest(), file) ==
+                     FastService::Status::SharedMemoryError,
+             "regular files are rejected") && ok;
+  if (file >= 0) {
+    close(file);
+  }
+  unlink(file_path.c_str());
+
+  return ok;
+}
+
+// A daemon started on a path that is not a socket must leave it alone.
+// Returns 0, 1 or kSkipReturnCode.
+int RunKeepsOtherFiles(const std::string& file_path, const std::string& program_source_file) {
+  FILE* file = std::fopen(file_path.c_str(), "w");
+  if (!file) {
+    std::perror("fopen");
+    return 1;
+  }
+  std::fclose(file);
+
+  pid_t daemon = fork();
+  if (daemon == 0) {
+    if (!HasOpenCLCPUDevice()) {
+      _exit(kSkipReturnCode);
+    }
+    _exit(RunFastDaemon(file_path, program_source_file, OpenCL::OpenCLDeviceType::CPU));
+  }
+  int status = 0;
+  waitpid(daemon, &status, 0);
+  if (WIFEXITED(status) && WEXITSTATUS(status) == kSkipReturnCode) {
+    unlink(file_path.c_str());
+    std::cout << "No OpenCL CPU device, skipping" << std::endl;
+    return kSkipReturnCode;
+  }
+  struct stat file_stat;
+  bool ok = Check(WIFEXITED(status) && WEXITSTATUS(status) == 1,
+                  "daemon refuses a path that is not a socket");
+  ok = Check(stat(file_path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode),
+             "daemon leaves the file in place") && ok;
+  unlink(file_path.c_str());
+  return ok ? 0 : 1;
+}
+
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " path/to/fast.cl" << std::endl;
+    return 1;
+  }
+  std::string program_source_file = argv[1];
+
+  char directory_template[] = "/tmp/fast_daemon_test_XXXXXX";
+  if (!mkdtemp(directory_template)) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string directory = directory_template;
+  std::string socket_path = directory + "/fast.sock";
+
+  // The daemons are forked before this process touches OpenCL, the runtime's
+  // threads don't survive a fork
+  int keeps_other_files = RunKeepsOtherFiles(directory + "/not_a_socket", program_source_file);
+  if (keeps_other_files == kSkipReturnCode) {
+    rmdir(directory.c_str());
+    return kSkipReturnCode;
+  }
+
+  pid_t daemon = fork();
+  if (daemon == 0) {
+    if (!HasOpenCLCPUDevice()) {
+      _exit(kSkipReturnCode);
+    }
+    RunFastDaemon(socket_path, program_source_file, OpenCL::OpenCLDeviceType::CPU);
+    _exit(1);
+  }
+
+  int wait_result = WaitForDaemon(daemon, socket_path);
+  if (wait_result != 0) {
+    rmdir(directory.c_str());
+    return wait_result;
+  }
+
+  std::vector<cv::Mat> frames = MakeFrames();
+  std::vector<Case> cases;
+  {
+    OpenCL::OpenCLHelper opencl_helper(OpenCL::OpenCLDeviceType::CPU);
+    auto program = opencl_helper.BuildProgramFromSourceFile(
+        program_source_file, OpenCL::FASTBuildOptions(OpenCL::FASTKernelVariant::Image2D));
+    for (size_t frame = 0; frame < frames.size(); frame++) {
+      for (int threshold : kThresholds) {
+        cases.push_back({static_cast<int>(frame), threshold,
+                         ExpectedKeypoints(opencl_helper, program, frames[frame], threshold)});
+      }
+    }
+    clReleaseProgram(program);
+  }
+
+  bool ok = keeps_other_files == 0;
+  ok = Check(RunClients(socket_path, frames, cases), "concurrent clients match RunOpenCLFAST") && ok;
+  ok = RunRejects(socket_path, directory) && ok;
+
+  kill(daemon, SIGTERM);
+  waitpid(daemon, nullptr, 0);
+  unlink(socket_path.c_str());
+  rmdir(directory.c_str());
+
+  std::cout << (ok ? "all daemon checks passed" : "daemon checks failed") << std::endl;
+  return ok ? 0 : 1;
+}
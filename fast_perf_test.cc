@@ -0,0 +1,133 @@
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "opencl_helper.h"
+
+#include "cpu_fast.h"
+#include "fast_test_util.h"
+
+// Throughput regression test on a 1080p synthetic image.
+//
+//   fast_perf_test path/to/fast.cl path/to/baseline.txt tolerance [--record]
+//
+// Each detector's median throughput in MPixel/s is compared with the baseline
+// file and the test fails when one drops by more than tolerance (0.25 = 25%).
+// Without a baseline the test is skipped. --record writes the current run as
+// the baseline instead of comparing, see the fast_perf_record target.
+
+namespace {
+
+const int kThreshold = 10;
+const int kImageWidth = 1920;
+const int kImageHeight = 1080;
+
+template <class F>
+double MedianMPixelPerSecond(int runs, F run) {
+  std::vector<double> throughput;
+  for (int i = 0; i < runs; i++) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    run();
+    auto end_time = std::chrono::high_resolution_clock::now();
+    double us = std::chrono::duration<double, std::micro>(end_time - start_time).count();
+    throughput.push_back(kImageWidth * kImageHeight / us);
+  }
+  std::sort(throughput.begin(), throughput.end());
+  return throughput[throughput.size() / 2];
+}
+
+std::map<std::string, double> LoadBaseline(const std::string& path) {
+  std::map<std::string, double> baseline;
+  std::ifstream ifs(path);
+  std::string name;
+  double value;
+  while (ifs >> name >> value) {
+    baseline[name] = value;
+  }
+  return baseline;
+}
+
+void SaveBaseline(const std::string& path, const std::map<std::string, double>& measured) {
+  std::ofstream ofs(path);
+  for (const auto& entry : measured) {
+    ofs << entry.first << " " << entry.second << "\n";
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    std::cout << "Usage: " << argv[0] << " path/to/fast.cl path/to/baseline.txt tolerance [--record]"
+              << std::endl;
+    return 1;
+  }
+  std::string program_source_file = argv[1];
+  std::string baseline_file = argv[2];
+  double tolerance = std::stod(argv[3]);
+  bool record = argc > 4 && std::string(argv[4]) == "--record";
+
+  std::map<std::string, double> baseline = LoadBaseline(baseline_file);
+  if (baseline.empty() && !record) {
+    std::cout << "No baseline in " << baseline_file
+              << ", skipping. Record one with --record (fast_perf_record target)" << std::endl;
+    return kSkipReturnCode;
+  }
+
+  SyntheticCorners synthetic = MakeSyntheticCorners(kImageWidth, kImageHeight);
+  std::map<std::string, double> measured;
+
+  measured["cpu"] = MedianMPixelPerSecond(5, [&]() {
+    cv::Mat cpu_output;
+    DetectFASTCornersWithNMS(synthetic.image, cpu_output, kThreshold);
+  });
+
+  measured["opencv"] = MedianMPixelPerSecond(21, [&]() {
+    std::vector<cv::KeyPoint> keypoints;
+    cv::FAST(synthetic.image, keypoints, kThreshold, true);
+  });
+
+  if (HasOpenCLCPUDevice()) {
+    OpenCL::OpenCLHelper opencl_helper(OpenCL::OpenCLDeviceType::CPU);
+    for (const OpenCL::FASTKernelVariantInfo& info : OpenCL::FAST_KERNEL_VARIANTS) {
+      auto program = opencl_helper.BuildProgramFromSourceFile(
+          program_source_file, OpenCL::FASTBuildOptions(info.variant));
+      // Warm up, some runtimes compile kernels lazily on first launch
+      RunOpenCLFAST(opencl_helper, program, synthetic.image, info.variant, kThreshold, nullptr, nullptr);
+      measured[std::string("opencl_") + info.name] = MedianMPixelPerSecond(21, [&]() {
+        RunOpenCLFAST(opencl_helper, program, synthetic.image, info.variant, kThreshold, nullptr, nullptr);
+      });
+      clReleaseProgram(program);
+    }
+  } else {
+    std::cout << "No OpenCL CPU device, only timing CPU detectors" << std::endl;
+  }
+
+  if (record) {
+    SaveBaseline(baseline_file, measured);
+    for (const auto& entry : measured) {
+      std::cout << entry.first << " : " << entry.second << " MPixel/s (recorded)" << std::endl;
+    }
+    std::cout << "Baseline written to " << baseline_file << std::endl;
+    return 0;
+  }
+
+  bool ok = true;
+  for (const auto& entry : measured) {
+    auto it = baseline.find(entry.first);
+    if (it == baseline.end()) {
+      std::cout << entry.first << " : " << entry.second << " MPixel/s (no baseline)" << std::endl;
+      continue;
+    }
+    double limit = it->second * (1.0 - tolerance);
+    bool regressed = entry.second < limit;
+    std::cout << entry.first << " : " << entry.second << " MPixel/s, baseline " << it->second
+              << (regressed ? " REGRESSED" : "") << std::endl;
+    ok = ok && !regressed;
+  }
+  return ok ? 0 : 1;
+}
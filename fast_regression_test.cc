@@ -0,0 +1,278 @@
+#include "opencv2/opencv.hpp"
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "opencl_helper.h"
+
+#include "cpu_fast.h"
+#include "fast_test_util.h"
+
+// Golden-output regression test: after NMS every implementation has to keep
+// exactly the corner pixels of the graded synthetic image, the raw detections
+// have to be exact when the rectangle contrast sits right at the threshold, and
+// the OpenCL ORB descriptors have to match a host reference.
+//
+//   fast_regression_test cpu                    CPU and OpenCV detectors
+//   fast_regression_test opencl path/to/fast.cl every OpenCL kernel variant
+
+namespace {
+
+const int kThreshold = 10;
+
+std::vector<cv::Point> SortedPoints(std::vector<cv::Point> points) {
+  std::sort(points.begin(), points.end(), [](const cv::Point& a, const cv::Point& b) {
+    return a.y != b.y ? a.y < b.y : a.x < b.x;
+  });
+  return points;
+}
+
+bool MatchesExactly(const std::string& name, const std::vector<cv::Point>& detected,
+                    const std::vector<cv::Point>& expected) {
+  std::vector<cv::Point> sorted_detected = SortedPoints(detected);
+  std::vector<cv::Point> sorted_expected = SortedPoints(expected);
+  bool same = sorted_detected.size() == sorted_expected.size() &&
+              std::equal(sorted_detected.begin(), sorted_detected.end(), sorted_expected.begin(),
+                         [](const cv::Point& a, const cv::Point& b) { return a.x == b.x && a.y == b.y; });
+  std::cout << name << " : " << detected.size() << " detections, expected " << expected.size()
+            << (same ? "" : " MISMATCH") << std::endl;
+  return same;
+}
+
+// Rectangle contrasts around kThreshold. cpu_fast.h counts a circle pixel that
+// differs by exactly the threshold (>=), FASTCorner and OpenCV require a
+// strictly larger difference, so the two disagree at contrast == threshold.
+const int kBoundaryContrasts[] = {kThreshold - 1, kThreshold, kThreshold + 1};
+
+SyntheticCorners MakeBoundaryCorners(int contrast) {
+  return MakeSyntheticCorners(640, 480, static_cast<uchar>(128 + contrast),
+                              static_cast<uchar>(128 - contrast));
+}
+
+std::vector<cv::Point> ExpectedAtBoundary(const SyntheticCorners& synthetic, int contrast,
+                                          bool counts_equal_difference) {
+  bool detected = counts_equal_difference ? contrast >= kThreshold : contrast > kThreshold;
+  return detected ? synthetic.segment_test_pixels : std::vector<cv::Point>();
+}
+
+int RunCPU() {
+  SyntheticCorners synthetic = MakeGradedCorners(640, 480);
+  bool ok = true;
+
+  cv::Mat cpu_output;
+  DetectFASTCornersWithNMS(synthetic.image, cpu_output, kThreshold);
+  ok = MatchesExactly("cpu", PointsFromMask(cpu_output), synthetic.corners) && ok;
+
+  std::vector<cv::KeyPoint> opencv_keypoints;
+  cv::FAST(synthetic.image, opencv_keypoints, kThreshold, true);
+  ok = MatchesExactly("opencv", PointsFromKeyPoints(opencv_keypoints), synthetic.corners) && ok;
+
+  for (int contrast : kBoundaryContrasts) {
+    SyntheticCorners boundary = MakeBoundaryCorners(contrast);
+    std::string suffix = "_contrast_" + std::to_string(contrast);
+
+    cv::Mat cpu_corners;
+    DetectFASTCorners(boundary.image, cpu_corners, kThreshold);
+    ok = MatchesExactly("cpu" + suffix, PointsFromMask(cpu_corners),
+                        ExpectedAtBoundary(boundary, contrast, true)) && ok;
+
+    std::vector<cv::KeyPoint> keypoints;
+    cv::FAST(boundary.image, keypoints, kThreshold, false);
+    ok = MatchesExactly("opencv" + suffix, PointsFromKeyPoints(keypoints),
+                        ExpectedAtBoundary(boundary, contrast, false)) && ok;
+  }
+
+  return ok ? 0 : 1;
+}
+
+// Host versions of ORBBlur, ORBOrientation and ORBDescriptor in fast.cl
+uchar ClampedPixel(const cv::Mat& image, int x, int y) {
+  x = std::min(std::max(x, 0), image.cols - 1);
+  y = std::min(std::max(y, 0), image.rows - 1);
+  return image.at<uchar>(y, x);
+}
+
+int Reflect101(int i, int n) {
+  i = i < 0 ? -i : i;
+  return i >= n ? 2 * n - 2 - i : i;
+}
+
+cv::Mat ReferenceBlur(const cv::Mat& image) {
+  cv::Mat weight = cv::getGaussianKernel(7, 2, CV_32F);
+  cv::Mat blurred(image.rows, image.cols, CV_8UC1);
+  for (int y = 0; y < image.rows; y++) {
+    for (int x = 0; x < image.cols; x++) {
+      float sum = 0.0f;
+      for (int dy = -3; dy <= 3; dy++) {
+        int row_y = Reflect101(y + dy, image.rows);
+        float row = 0.0f;
+        for (int dx = -3; dx <= 3; dx++) {
+          row += weight.at<float>(dx + 3) * image.at<uchar>(row_y, Reflect101(x + dx, image.cols));
+        }
+        sum += weight.at<float>(dy + 3) * row;
+      }
+      blurred.at<uchar>(y, x) = cv::saturate_cast<uchar>(sum);
+    }
+  }
+  return blurred;
+}
+
+float ReferenceOrientation(const cv::Mat& image, int x, int y) {
+  const int radius = OpenCL::ORB_HALF_PATCH_SIZE;
+  std::vector<int> umax = OpenCL::OrbUMax();
+  int m_01 = 0;
+  int m_10 = 0;
+  for (int dy = -radius; dy <= radius; dy++) {
+    int dx_max = umax[std::abs(dy)];
+    for (int dx = -dx_max; dx <= dx_max; dx++) {
+      int pixel = ClampedPixel(image, x + dx, y + dy);
+      m_10 += dx * pixel;
+      m_01 += dy * pixel;
+    }
+  }
+  return std::atan2(static_cast<float>(m_01), static_cast<float>(m_10));
+}
+
+void ReferenceDescriptor(const cv::Mat& blurred, int x, int y, float angle,
+                         const std::vector<cl_char4>& pattern, uchar* descriptor) {
+  float cos_angle = std::cos(angle);
+  float sin_angle = std::sin(angle);
+  for (int b = 0; b < OpenCL::ORB_DESCRIPTOR_BYTES; b++) {
+    uchar value = 0;
+    for (int k = 0; k < 8; k++) {
+      const cl_char4& test = pattern[b * 8 + k];
+      int x1 = Reflect101(x + cvRound(test.s[0] * cos_angle - test.s[1] * sin_angle), blurred.cols);
+      int y1 = Reflect101(y + cvRound(test.s[0] * sin_angle + test.s[1] * cos_angle), blurred.rows);
+      int x2 = Reflect101(x + cvRound(test.s[2] * cos_angle - test.s[3] * sin_angle), blurred.cols);
+      int y2 = Reflect101(y + cvRound(test.s[2] * sin_angle + test.s[3] * cos_angle), blurred.rows);
+      if (blurred.at<uchar>(y1, x1) < blurred.at<uchar>(y2, x2)) {
+        value |= static_cast<uchar>(1 << k);
+      }
+    }
+    descriptor[b] = value;
+  }
+}
+
+// The device and host trigonometry may differ in the last bits, which can move
+// a rotated test point that sits within rounding error of a half pixel. Allow a
+// few such bits, anything beyond that is a real mismatch.
+const int kMaxDescriptorBitErrors = 8;
+const double kMinExactDescriptorFraction = 0.9;
+const double kMaxAngleError = 1e-3;
+
+bool MatchesReferenceORB(const cv::Mat& image, const std::vector<cv::KeyPoint>& keypoints,
+                         const cv::Mat& descriptors) {
+  std::vector<cl_char4> pattern = OpenCL::OrbPattern();
+  cv::Mat blurred = ReferenceBlur(image);
+
+  int exact = 0;
+  int worst_bits = 0;
+  double worst_angle_error = 0;
+  for (size_t i = 0; i < keypoints.size(); i++) {
+    int x = cvRound(keypoints[i].pt.x);
+    int y = cvRound(keypoints[i].pt.y);
+    float angle = ReferenceOrientation(image, x, y);
+    double device_angle = keypoints[i].angle * CV_PI / 180.0;
+    worst_angle_error = std::max(worst_angle_error,
+                                 std::abs(std::remainder(device_angle - angle, 2 * CV_PI)));
+
+    uchar reference[OpenCL::ORB_DESCRIPTOR_BYTES];
+    ReferenceDescriptor(blurred, x, y, angle, pattern, reference);
+    int bits = 0;
+    for (int b = 0; b < OpenCL::ORB_DESCRIPTOR_BYTES; b++) {
+      bits += static_cast<int>(
+          std::bitset<8>(reference[b] ^ descriptors.at<uchar>(static_cast<int>(i), b)).count());
+    }
+    exact += bits == 0;
+    worst_bits = std::max(worst_bits, bits);
+  }
+
+  bool ok = !keypoints.empty() && worst_angle_error < kMaxAngleError &&
+            worst_bits <= kMaxDescriptorBitErrors &&
+            exact >= kMinExactDescriptorFraction * keypoints.size();
+  std::cout << "opencl_orb_reference : " << exact << " of " << keypoints.size()
+            << " descriptors exact, worst " << worst_bits << " bits, worst angle error "
+            << worst_angle_error << (ok ? "" : " MISMATCH") << std::endl;
+  return ok;
+}
+
+int RunOpenCL(const std::string& program_source_file) {
+  if (!HasOpenCLCPUDevice()) {
+    std::cout << "No OpenCL CPU device, skipping" << std::endl;
+    return kSkipReturnCode;
+  }
+
+  SyntheticCorners synthetic = MakeGradedCorners(640, 480);
+  OpenCL::OpenCLHelper opencl_helper(OpenCL::OpenCLDeviceType::CPU);
+  bool ok = true;
+
+  cv::Mat reference_scores;
+  cv::Mat reference_nms;
+  std::string reference_name;
+  for (const OpenCL::FASTKernelVariantInfo& info : OpenCL::FAST_KERNEL_VARIANTS) {
+    std::string name = std::string("opencl_") + info.name;
+    auto program = opencl_helper.BuildProgramFromSourceFile(
+        program_source_file, OpenCL::FASTBuildOptions(info.variant));
+
+    cv::Mat scores;
+    cv::Mat nms;
+    RunOpenCLFAST(opencl_helper, program, synthetic.image, info.variant, kThreshold, &scores, &nms);
+    ok = MatchesExactly(name, PointsFromMask(nms), synthetic.corners) && ok;
+
+    // The buffer kernels must reproduce the image2d score map exactly
+    if (reference_scores.empty()) {
+      reference_scores = scores;
+      reference_nms = nms;
+      reference_name = name;
+    } else if (cv::countNonZero(reference_scores != scores) != 0 ||
+               cv::countNonZero(reference_nms != nms) != 0) {
+      std::cerr << name << " : output differs from " << reference_name << std::endl;
+      ok = false;
+    }
+
+    for (int contrast : kBoundaryContrasts) {
+      SyntheticCorners boundary = MakeBoundaryCorners(contrast);
+      cv::Mat boundary_scores;
+      RunOpenCLFAST(opencl_helper, program, boundary.image, info.variant, kThreshold,
+                    &boundary_scores, nullptr);
+      ok = MatchesExactly(name + "_contrast_" + std::to_string(contrast),
+                          PointsFromMask(boundary_scores),
+                          ExpectedAtBoundary(boundary, contrast, false)) && ok;
+    }
+    clReleaseProgram(program);
+  }
+
+  auto program = opencl_helper.BuildProgramFromSourceFile(program_source_file);
+  std::vector<cv::KeyPoint> orb_keypoints;
+  cv::Mat orb_descriptors;
+  opencl_helper.DetectAndDescribe(program, synthetic.image, kThreshold, &orb_keypoints,
+                                  &orb_descriptors);
+  ok = MatchesExactly("opencl_orb", PointsFromKeyPoints(orb_keypoints), synthetic.corners) && ok;
+  if (orb_descriptors.rows != static_cast<int>(orb_keypoints.size()) ||
+      orb_descriptors.cols != OpenCL::ORB_DESCRIPTOR_BYTES) {
+    std::cerr << "opencl_orb : descriptor matrix is " << orb_descriptors.rows << " x "
+              << orb_descriptors.cols << " for " << orb_keypoints.size() << " keypoints" << std::endl;
+    ok = false;
+  } else {
+    ok = MatchesReferenceORB(synthetic.image, orb_keypoints, orb_descriptors) && ok;
+  }
+  clReleaseProgram(program);
+
+  return ok ? 0 : 1;
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string mode = argc > 1 ? argv[1] : "";
+  if (mode == "cpu") {
+    return RunCPU();
+  }
+  if (mode == "opencl" && argc > 2) {
+    return RunOpenCL(argv[2]);
+  }
+  std::cout << "Usage: " << argv[0] << " cpu | opencl path/to/fast.cl" << std::endl;
+  return 1;
+}
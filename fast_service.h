@@ -0,0 +1,281 @@
+#ifndef FAST_SERVICE_H
+#define FAST_SERVICE_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <opencv2/core.hpp>
+
+// Wire protocol of the fast detection daemon (fast --daemon=<socket>).
+//
+// A client writes a gray image into a memfd and sends a Request over a
+// Unix-domain stream socket, with the memfd attached as SCM_RIGHTS. The daemon
+// answers with a ResponseHeader followed by keypoint_count PackedKeypoints.
+// Requests on one connection are answered in order; the image must not be
+// modified until the response has arrived. The daemon only reads memory the
+// client passed it, and only from a memfd sealed with F_SEAL_SHRINK: the client
+// may grow it but can't truncate it under the daemon's mapping.
+namespace FastService {
+
+constexpr uint32_t kRequestMagic = 0x32545346;  // "FST2"
+constexpr uint32_t kMaxImageSide = 16384;
+
+enum Status : int32_t {
+  Ok = 0,
+  BadRequest = 1,
+  // No memfd came with the request, it isn't sealed against shrinking or it
+  // is smaller than the image
+  SharedMemoryError = 2,
+  // Larger than the daemon's OpenCL device can hold
+  ImageTooLarge = 3,
+  // The device failed to allocate or run this request, later ones may succeed
+  DeviceError = 4,
+};
+
+struct Request {
+  uint32_t magic;
+  uint32_t width;
+  uint32_t height;
+  int32_t threshold;
+};
+
+struct ResponseHeader {
+  int32_t status;
+  uint32_t keypoint_count;
+};
+
+struct PackedKeypoint {
+  uint16_t x;
+  uint16_t y;
+  uint16_t score;
+  uint16_t reserved;
+};
+static_assert(sizeof(PackedKeypoint) == 8, "PackedKeypoint is part of the wire format");
+
+// Blocking helpers that retry on short reads/writes
+inline bool SendAll(int fd, const void* data, size_t length) {
+  const char* ptr = static_cast<const char*>(data);
+  while (length > 0) {
+    ssize_t sent = send(fd, ptr, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    ptr += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+inline bool RecvAll(int fd, void* data, size_t length) {
+  char* ptr = static_cast<char*>(data);
+  while (length > 0) {
+    ssize_t received = recv(fd, ptr, length, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return false;
+    }
+    ptr += received;
+    length -= received;
+  }
+  return true;
+}
+
+// Sends request with memory_fd attached, -1 sends no descriptor
+inline bool SendRequest(int fd, const Request& request, int memory_fd) {
+  iovec io = {const_cast<Request*>(&request), sizeof(request)};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr message = {};
+  message.msg_iov = &io;
+  message.msg_iovlen = 1;
+  if (memory_fd >= 0) {
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &memory_fd, sizeof(int));
+  }
+  ssize_t sent = -1;
+  do {
+    sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent <= 0) {
+    return false;
+  }
+  // The descriptor went with the first bytes, the rest is plain data
+  return SendAll(fd, reinterpret_cast<const char*>(&request) + sent, sizeof(request) - sent);
+}
+
+// Receives one request and the descriptor sent with it. *memory_fd is -1 when
+// none came, otherwise the caller closes it. Extra descriptors are closed.
+inline bool RecvRequest(int fd, Request* request, int* memory_fd) {
+  *memory_fd = -1;
+  iovec io = {request, sizeof(*request)};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr message = {};
+  message.msg_iov = &io;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t received = -1;
+  do {
+    received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  if (received <= 0) {
+    return false;
+  }
+  for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr;
+       header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t fd_count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < fd_count; i++) {
+      int received_fd;
+      std::memcpy(&received_fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+      if (*memory_fd < 0) {
+        *memory_fd = received_fd;
+      } else {
+        close(received_fd);
+      }
+    }
+  }
+  if (!RecvAll(fd, reinterpret_cast<char*>(request) + received, sizeof(*request) - received)) {
+    if (*memory_fd >= 0) {
+      close(*memory_fd);
+      *memory_fd = -1;
+    }
+    return false;
+  }
+  return true;
+}
+
+// One connection to the daemon plus a memfd that is reused for every frame
+// and grown when a larger frame arrives. It is sealed against shrinking when
+// created. Not thread safe, use one FastClient per thread.
+class FastClient {
+public:
+  FastClient() = default;
+
+  ~FastClient() {
+    if (memory_data_) {
+      munmap(memory_data_, memory_size_);
+    }
+    if (memory_fd_ >= 0) {
+      close(memory_fd_);
+    }
+    if (socket_fd_ >= 0) {
+      close(socket_fd_);
+    }
+  }
+
+  FastClient(const FastClient&) = delete;
+  FastClient& operator=(const FastClient&) = delete;
+
+  bool Connect(const std::string& socket_path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+      return false;
+    }
+    std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    socket_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd_ < 0) {
+      return false;
+    }
+    return connect(socket_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+  }
+
+  // gray_image must be CV_8UC1. Returns false on transport errors or when the
+  // daemon rejects the request.
+  bool Detect(const cv::Mat& gray_image, int threshold, std::vector<PackedKeypoint>* keypoints) {
+    keypoints->clear();
+    size_t image_size = gray_image.total();
+    if (gray_image.type() != CV_8UC1 || !Reserve(image_size)) {
+      return false;
+    }
+    if (gray_image.isContinuous()) {
+      std::memcpy(memory_data_, gray_image.data, image_size);
+    } else {
+      cv::Mat shared(gray_image.rows, gray_image.cols, CV_8UC1, memory_data_);
+      gray_image.copyTo(shared);
+    }
+
+    Request request = {};
+    request.magic = kRequestMagic;
+    request.width = gray_image.cols;
+    request.height = gray_image.rows;
+    request.threshold = threshold;
+
+    ResponseHeader header;
+    if (!SendRequest(socket_fd_, request, memory_fd_) ||
+        !RecvAll(socket_fd_, &header, sizeof(header))) {
+      return false;
+    }
+    keypoints->resize(header.keypoint_count);
+    if (header.keypoint_count > 0 &&
+        !RecvAll(socket_fd_, keypoints->data(), header.keypoint_count * sizeof(PackedKeypoint))) {
+      return false;
+    }
+    return header.status == Status::Ok;
+  }
+
+private:
+  bool Reserve(size_t size) {
+    if (size <= memory_size_) {
+      return true;
+    }
+    if (memory_fd_ < 0) {
+      memory_fd_ = memfd_create("fast_client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+      if (memory_fd_ < 0) {
+        return false;
+      }
+      if (fcntl(memory_fd_, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+        close(memory_fd_);
+        memory_fd_ = -1;
+        return false;
+      }
+    }
+    if (memory_data_) {
+      munmap(memory_data_, memory_size_);
+      memory_data_ = nullptr;
+      memory_size_ = 0;
+    }
+    if (ftruncate(memory_fd_, size) != 0) {
+      return false;
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd_, 0);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    memory_data_ = data;
+    memory_size_ = size;
+    return true;
+  }
+
+  int socket_fd_ = -1;
+  int memory_fd_ = -1;
+  void* memory_data_ = nullptr;
+  size_t memory_size_ = 0;
+};
+
+}
+
+#endif // FAST_SERVICE_H
@@ -0,0 +1,179 @@
+#ifndef FAST_TEST_UTIL_H
+#define FAST_TEST_UTIL_H
+
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "opencl_helper.h"
+
+// ctest reports a test that exits with this code as skipped
+constexpr int kSkipReturnCode = 77;
+
+// Prints what failed and passes condition through, for ok = Check(...) && ok
+inline bool Check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "failed : " << what << std::endl;
+    }
+    return condition;
+}
+
+// Synthetic gray image with a known set of corners for the regression and
+// performance tests: a grid of axis aligned rectangles on a flat background,
+// alternating brighter and darker than the background so both FAST polarities
+// are covered. Rectangles are far enough apart that FAST circles never see two
+// of them, and straight edges never pass the 9 pixel arc test.
+struct SyntheticCorners {
+    cv::Mat image;
+    // Innermost pixel of every rectangle corner
+    std::vector<cv::Point> corners;
+    // Every pixel that passes the 9 pixel segment test once the rectangle
+    // contrast clears the threshold: each corner pixel and the pixels inside
+    // the rectangle at most two steps away from it along the rows and columns
+    std::vector<cv::Point> segment_test_pixels;
+};
+
+// background is 128, bright and dark set the two rectangle intensities
+inline SyntheticCorners MakeSyntheticCorners(int width, int height, uchar bright = 220,
+                                             uchar dark = 30) {
+    const int cell_size = 48;
+    const int margin = 24;
+    const int rect_size = 24;
+    const uchar background = 128;
+
+    SyntheticCorners synthetic;
+    synthetic.image = cv::Mat(height, width, CV_8UC1, cv::Scalar(background));
+
+    int index = 0;
+    for (int y0 = margin; y0 + rect_size + margin <= height; y0 += cell_size) {
+        for (int x0 = margin; x0 + rect_size + margin <= width; x0 += cell_size, index++) {
+            uchar value = (index % 2 == 0) ? bright : dark;
+            synthetic.image(cv::Rect(x0, y0, rect_size, rect_size)).setTo(cv::Scalar(value));
+
+            int x1 = x0 + rect_size - 1;
+            int y1 = y0 + rect_size - 1;
+            synthetic.corners.push_back(cv::Point(x0, y0));
+            synthetic.corners.push_back(cv::Point(x1, y0));
+            synthetic.corners.push_back(cv::Point(x0, y1));
+            synthetic.corners.push_back(cv::Point(x1, y1));
+
+            const cv::Point inward[4] = {cv::Point(1, 1), cv::Point(-1, 1), cv::Point(1, -1),
+                                         cv::Point(-1, -1)};
+            for (int c = 0; c < 4; c++) {
+                cv::Point corner = synthetic.corners[synthetic.corners.size() - 4 + c];
+                for (int dy = 0; dy <= 2; dy++) {
+                    for (int dx = 0; dx + dy <= 2; dx++) {
+                        synthetic.segment_test_pixels.push_back(
+                            cv::Point(corner.x + dx * inward[c].x, corner.y + dy * inward[c].y));
+                    }
+                }
+            }
+        }
+    }
+    return synthetic;
+}
+
+// MakeSyntheticCorners with each rectangle pushed further from the background
+// towards its corners, by 4 levels per pixel over the 3 pixels nearest the
+// corner (Manhattan distance). On flat rectangles the 6 segment test pixels of
+// a corner share one score and all survive a strict NMS; here the corner pixel
+// is the single strict maximum, so every NMS keeps exactly synthetic.corners.
+// segment_test_pixels still lists the raw detections.
+inline SyntheticCorners MakeGradedCorners(int width, int height) {
+    const int ramp_pixels = 3;
+    const int ramp_step = 4;
+    const uchar background = 128;
+
+    SyntheticCorners synthetic = MakeSyntheticCorners(width, height);
+    const cv::Point inward[4] = {cv::Point(1, 1), cv::Point(-1, 1), cv::Point(1, -1),
+                                 cv::Point(-1, -1)};
+    for (size_t i = 0; i < synthetic.corners.size(); i++) {
+        cv::Point corner = synthetic.corners[i];
+        int sign = synthetic.image.at<uchar>(corner.y, corner.x) > background ? 1 : -1;
+        for (int dy = 0; dy < ramp_pixels; dy++) {
+            for (int dx = 0; dx + dy < ramp_pixels; dx++) {
+                uchar& pixel = synthetic.image.at<uchar>(corner.y + dy * inward[i % 4].y,
+                                                         corner.x + dx * inward[i % 4].x);
+                pixel = cv::saturate_cast<uchar>(pixel + sign * ramp_step * (ramp_pixels - dx - dy));
+            }
+        }
+    }
+    return synthetic;
+}
+
+inline std::vector<cv::Point> PointsFromMask(const cv::Mat& mask) {
+    std::vector<cv::Point> points;
+    for (int row = 0; row < mask.rows; row++) {
+        for (int col = 0; col < mask.cols; col++) {
+            if (mask.at<uchar>(row, col) > 0) {
+                points.push_back(cv::Point(col, row));
+            }
+        }
+    }
+    return points;
+}
+
+inline std::vector<cv::Point> PointsFromKeyPoints(const std::vector<cv::KeyPoint>& keypoints) {
+    std::vector<cv::Point> points;
+    for (const auto& kp : keypoints) {
+        points.push_back(cv::Point(cvRound(kp.pt.x), cvRound(kp.pt.y)));
+    }
+    return points;
+}
+
+// The OpenCL tests run on a CPU runtime such as POCL so they work without a GPU.
+// OpenCLHelper exits when it finds no device, so check before constructing it.
+inline bool HasOpenCLCPUDevice() {
+    cl_uint num_platforms = 0;
+    if (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS || num_platforms == 0) {
+        return false;
+    }
+    std::vector<cl_platform_id> platforms(num_platforms);
+    clGetPlatformIDs(num_platforms, platforms.data(), NULL);
+    for (cl_platform_id platform : platforms) {
+        cl_uint num_devices = 0;
+        if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_CPU, 0, NULL, &num_devices) == CL_SUCCESS &&
+            num_devices > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Score map and NMS map of one FAST kernel variant, with the same launch
+// parameters as OpenCL::OpenCLFast. program must be built with
+// OpenCL::FASTBuildOptions(variant). Waits for the device before returning.
+inline void RunOpenCLFAST(OpenCL::OpenCLHelper& opencl_helper, cl_program program,
+                          const cv::Mat& image, OpenCL::FASTKernelVariant variant, int threshold,
+                          cv::Mat* scores, cv::Mat* nms) {
+    size_t image_width = image.cols;
+    size_t image_height = image.rows;
+
+    cl_mem image_buffer = opencl_helper.CreateFASTInput(variant, image_width, image_height, image.data);
+    cl_mem corner_buffer = opencl_helper.CreateBufferReadWrite(image_width * image_height);
+    cl_mem nms_buffer = opencl_helper.CreateBufferReadWrite(image_width * image_height);
+
+    opencl_helper.RunFAST(program, variant, image_buffer, corner_buffer, image_width, image_height,
+                          threshold);
+
+    cl_kernel nms_kernel = opencl_helper.CreateKernel(program, "NonMaximumSuppression");
+    opencl_helper.KernelBindArgs(nms_kernel, corner_buffer, nms_buffer, 3);
+    opencl_helper.KernelRun(nms_kernel, image_width, image_height, 1);
+    opencl_helper.Finish();
+
+    if (scores) {
+        scores->create(image.size(), CV_8UC1);
+        opencl_helper.CopyToHost(corner_buffer, scores->data, image_width * image_height);
+    }
+    if (nms) {
+        nms->create(image.size(), CV_8UC1);
+        opencl_helper.CopyToHost(nms_buffer, nms->data, image_width * image_height);
+    }
+
+    clReleaseKernel(nms_kernel);
+    clReleaseMemObject(image_buffer);
+    clReleaseMemObject(corner_buffer);
+    clReleaseMemObject(nms_buffer);
+}
+
+#endif // FAST_TEST_UTIL_H
@@ -0,0 +1,98 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+// Bounded lock-free ring for exactly one producer thread and one consumer thread.
+//
+// Items are exchanged with std::swap instead of copied: Push hands the item to
+// a slot and gives the caller back whatever that slot held before, Pop does the
+// reverse. With cv::Mat members this means the same few image buffers circulate
+// between the threads and are never reallocated or deep-copied.
+template <class T, size_t Capacity>
+class FrameRing {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of two");
+
+public:
+    bool TryPush(T& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == Capacity) {
+            return false;
+        }
+        std::swap(slots_[tail & (Capacity - 1)], item);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(T& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        std::swap(slots_[head & (Capacity - 1)], item);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Waits until there is room. Returns false if the ring is closed, an item
+    // is never pushed into a closed ring.
+    bool Push(T& item) {
+        for (int attempt = 0;; attempt++) {
+            if (closed_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            if (TryPush(item)) {
+                return true;
+            }
+            Backoff(attempt);
+        }
+    }
+
+    // Waits until an item arrives. Returns false once the ring is closed and drained.
+    bool Pop(T& item) {
+        for (int attempt = 0;; attempt++) {
+            if (TryPop(item)) {
+                return true;
+            }
+            if (closed_.load(std::memory_order_acquire)) {
+                return TryPop(item);
+            }
+            Backoff(attempt);
+        }
+    }
+
+    // Either side may close: the producer at end of stream, the consumer to
+    // stop a producer blocked in Push.
+    void Close() { closed_.store(true, std::memory_order_release); }
+
+private:
+    // Yield for the first few attempts so a hand-off between busy threads stays
+    // cheap, then sleep with exponential backoff up to ~1 ms so a side waiting
+    // on a stalled decoder or a slow consumer does not burn a core.
+    static void Backoff(int attempt) {
+        if (attempt < kSpinAttempts) {
+            std::this_thread::yield();
+            return;
+        }
+        int shift = std::min(attempt - kSpinAttempts, kMaxBackoffShift);
+        std::this_thread::sleep_for(std::chrono::microseconds(kMinSleepMicroseconds << shift));
+    }
+
+    static constexpr int kSpinAttempts = 64;
+    static constexpr int kMinSleepMicroseconds = 16;
+    static constexpr int kMaxBackoffShift = 6;
+
+    std::array<T, Capacity> slots_;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    std::atomic<bool> closed_{false};
+};
+
+#endif // FRAME_RING_H
@@ -5,6 +5,8 @@
 #include <string>
 #include <iostream>
 #include "opencl_helper.h"
+#include "fast_daemon.h"
+#include "trace.h"
 
 #include "cpu_fast.h"
 
@@ -14,17 +16,63 @@ cv::Ptr<cv::FastFeatureDetector> fastDetector = cv::FastFeatureDetector::create(
 
 int main(int argc, char** argv) {
   if (argc < 2) {
-    std::cout << "Usage: " << argv[0] << " path/to/images";
+    std::cout << "Usage: " << argv[0] << " path/to/images [--kernel=image2d|buffer4|buffer8|buffer16] [--target=N] [--orb]\n"
+              << "       " << argv[0] << " --daemon=path/to/socket [--device=cpu|gpu]";
     return 1;
   }
-  cv::Mat img = cv::imread(argv[1]);
+
+  const std::string daemon_flag = "--daemon=";
+  if (std::string(argv[1]).rfind(daemon_flag, 0) == 0) {
+    OpenCL::OpenCLDeviceType device_type = OpenCL::OpenCLDeviceType::GPU;
+    if (argc > 2 && std::string(argv[2]) == "--device=cpu") {
+      device_type = OpenCL::OpenCLDeviceType::CPU;
+    }
+    return RunFastDaemon(std::string(argv[1]).substr(daemon_flag.size()), "../fast.cl", device_type);
+  }
+
+  OpenCL::FASTKernelVariant kernel_variant = OpenCL::FASTKernelVariant::Image2D;
+  int target_keypoints = 0;
+  bool run_orb = false;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--orb") {
+      run_orb = true;
+      continue;
+    }
+    const std::string kernel_flag = "--kernel=";
+    const std::string target_flag = "--target=";
+    if (arg.rfind(kernel_flag, 0) == 0 &&
+        OpenCL::ParseFASTKernelVariant(arg.substr(kernel_flag.size()), &kernel_variant)) {
+      continue;
+    }
+    if (arg.rfind(target_flag, 0) == 0) {
+      target_keypoints = std::atoi(arg.substr(target_flag.size()).c_str());
+      if (target_keypoints > 0) {
+        continue;
+      }
+    }
+    std::cerr << "Unknown argument : " << arg << std::endl;
+    return 1;
+  }
+  TRACE_THREAD_NAME("main");
+  cv::Mat img;
+  {
+    TRACE_SCOPE("imread");
+    img = cv::imread(argv[1]);
+  }
   cv::Mat image_gray;
-  cv::cvtColor(img, image_gray, cv::COLOR_BGR2GRAY);
+  {
+    TRACE_SCOPE("cvtColor");
+    cv::cvtColor(img, image_gray, cv::COLOR_BGR2GRAY);
+  }
 
   cv::imwrite("gray.png", image_gray);
 
   std::vector<cv::KeyPoint> keypoints;
-  fastDetector->detect(image_gray, keypoints);
+  {
+    TRACE_SCOPE("opencv_fast");
+    fastDetector->detect(image_gray, keypoints);
+  }
 
   cv::Mat fast_img;
   cv::drawKeypoints(img, keypoints, fast_img);
@@ -43,7 +91,10 @@ int main(int argc, char** argv) {
 
 // Detect FAST corners using CPU implementation
 cv::Mat cpu_output;
-DetectFASTCornersWithNMS(image_gray, cpu_output, 10);
+{
+  TRACE_SCOPE("cpu_fast");
+  DetectFASTCornersWithNMS(image_gray, cpu_output, 10);
+}
 
 // Convert detected corners to keypoints
 std::vector<cv::KeyPoint> cpu_keypoints;
@@ -61,6 +112,21 @@ cv::drawKeypoints(img, cpu_keypoints, fast_cpu_img);
 cv::imwrite("fast_cpu.png", fast_cpu_img);
 std::cout << "CPU Detect : " << cpu_keypoints.size() << std::endl;
 
-OpenCL::OpenCLFast(image_gray, "../fast.cl", "opencl_output.png");
+// One context and program build for every OpenCL pass
+OpenCL::OpenCLHelper opencl_helper;
+auto program = opencl_helper.BuildProgramFromSourceFile("../fast.cl",
+                                                        OpenCL::FASTBuildOptions(kernel_variant));
+
+OpenCL::OpenCLFast(opencl_helper, program, image_gray, "opencl_output.png", kernel_variant);
+if (run_orb) {
+  OpenCL::OpenCLORB(opencl_helper, program, image_gray, "orb_opencl.png");
+}
+if (target_keypoints > 0) {
+  OpenCL::OpenCLFastAdaptive(opencl_helper, program, image_gray, "fast_opencl_adaptive.png",
+                             target_keypoints);
+}
+clReleaseProgram(program);
+
+TRACE_WRITE("fast_trace.json");
 }
 
@@ -3,18 +3,159 @@
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstring>
 
 namespace OpenCL {
 
+namespace {
+
+// bit_pattern_31_ from OpenCV's orb.cpp: the 256 rBRIEF test pairs learned
+// for a 31x31 patch, as (x1, y1, x2, y2)
+const int kOrbBitPattern31[ORB_DESCRIPTOR_BYTES * 8 * 4] = {
+    8, -3, 9, 5, 4, 2, 7, -12, -11, 9, -8, 2, 7, -12, 12, -13,
+    2, -13, 2, 12, 1, -7, 1, 6, -2, -10, -2, -4, -13, -13, -11, -8,
+    -13, -3, -12, -9, 10, 4, 11, 9, -13, -8, -8, -9, -11, 7, -9, 12,
+    7, 7, 12, 6, -4, -5, -3, 0, -13, 2, -12, -3, -9, 0, -7, 5,
+    12, -6, 12, -1, -3, 6, -2, 12, -6, -13, -4, -8, 11, -13, 12, -8,
+    4, 7, 5, 1, 5, -3, 10, -3, 3, -7, 6, 12, -8, -7, -6, -2,
+    -2, 11, -1, -10, -13, 12, -8, 10, -7, 3, -5, -3, -4, 2, -3, 7,
+    -10, -12, -6, 11, 5, -12, 6, -7, 5, -6, 7, -1, 1, 0, 4, -5,
+    9, 11, 11, -13, 4, 7, 4, 12, 2, -1, 4, 4, -4, -12, -2, 7,
+    -8, -5, -7, -10, 4, 11, 9, 12, 0, -8, 1, -13, -13, -2, -8, 2,
+    -3, -2, -2, 3, -6, 9, -4, -9, 8, 12, 10, 7, 0, 9, 1, 3,
+    7, -5, 11, -10, -13, -6, -11, 0, 10, 7, 12, 1, -6, -3, -6, 12,
+    10, -9, 12, -4, -13, 8, -8, -12, -13, 0, -8, -4, 3, 3, 7, 8,
+    5, 7, 10, -7, -1, 7, 1, -12, 3, -10, 5, 6, 2, -4, 3, -10,
+    -13, 0, -13, 5, -13, -7, -12, 12, -13, 3, -11, 8, -7, 12, -4, 7,
+    6, -10, 12, 8, -9, -1, -7, -6, -2, -5, 0, 12, -12, 5, -7, 5,
+    3, -10, 8, -13, -7, -7, -4, 5, -3, -2, -1, -7, 2, 9, 5, -11,
+    -11, -13, -5, -13, -1, 6, 0, -1, 5, -3, 5, 2, -4, -13, -4, 12,
+    -9, -6, -9, 6, -12, -10, -8, -4, 10, 2, 12, -3, 7, 12, 12, 12,
+    -7, -13, -6, 5, -4, 9, -3, 4, 7, -1, 12, 2, -7, 6, -5, 1,
+    -13, 11, -12, 5, -3, 7, -2, -6, 7, -8, 12, -7, -13, -7, -11, -12,
+    1, -3, 12, 12, 2, -6, 3, 0, -4, 3, -2, -13, -1, -13, 1, 9,
+    7, 1, 8, -6, 1, -1, 3, 12, 9, 1, 12, 6, -1, -9, -1, 3,
+    -13, -13, -10, 5, 7, 7, 10, 12, 12, -5, 12, 9, 6, 3, 7, 11,
+    5, -13, 6, 10, 2, -12, 2, 3, 3, 8, 4, -6, 2, 6, 12, -13,
+    9, -12, 10, 3, -8, 4, -7, 9, -11, 12, -4, -6, 1, 12, 2, -8,
+    6, -9, 7, -4, 2, 3, 3, -2, 6, 3, 11, 0, 3, -3, 8, -8,
+    7, 8, 9, 3, -11, -5, -6, -4, -10, 11, -5, 10, -5, -8, -3, 12,
+    -10, 5, -9, 0, 8, -1, 12, -6, 4, -6, 6, -11, -10, 12, -8, 7,
+    4, -2, 6, 7, -2, 0, -2, 12, -5, -8, -5, 2, 7, -6, 10, 12,
+    -9, -13, -8, -8, -5, -13, -5, -2, 8, -8, 9, -13, -9, -11, -9, 0,
+    1, -8, 1, -2, 7, -4, 9, 1, -2, 1, -1, -4, 11, -6, 12, -11,
+    -12, -9, -6, 4, 3, 7, 7, 12, 5, 5, 10, 8, 0, -4, 2, 8,
+    -9, 12, -5, -13, 0, 7, 2, 12, -1, 2, 1, 7, 5, 11, 7, -9,
+    3, 5, 6, -8, -13, -4, -8, 9, -5, 9, -3, -3, -4, -7, -3, -12,
+    6, 5, 8, 0, -7, 6, -6, 12, -13, 6, -5, -2, 1, -10, 3, 10,
+    4, 1, 8, -4, -2, -2, 2, -13, 2, -12, 12, 12, -2, -13, 0, -6,
+    4, 1, 9, 3, -6, -10, -3, -5, -3, -13, -1, 1, 7, 5, 12, -11,
+    4, -2, 5, -7, -13, 9, -9, -5, 7, 1, 8, 6, 7, -8, 7, 6,
+    -7, -4, -7, 1, -8, 11, -7, -8, -13, 6, -12, -8, 2, 4, 3, 9,
+    10, -5, 12, 3, -6, -5, -6, 7, 8, -3, 9, -8, 2, -12, 2, 8,
+    -11, -2, -10, 3, -12, -13, -7, -9, -11, 0, -10, -5, 5, -3, 11, 8,
+    -2, -13, -1, 12, -1, -8, 0, 9, -13, -11, -12, -5, -10, -2, -10, 11,
+    -3, 9, -2, -13, 2, -3, 3, 2, -9, -13, -4, 0, -4, 6, -3, -10,
+    -4, 12, -2, -7, -6, -11, -4, 9, 6, -3, 6, 11, -13, 11, -5, 5,
+    11, 11, 12, 6, 7, -5, 12, -2, -1, 12, 0, 7, -4, -8, -3, -2,
+    -7, 1, -6, 7, -13, -12, -8, -13, -7, -2, -6, -8, -8, 5, -6, -9,
+    -5, -1, -4, 5, -13, 7, -8, 10, 1, 5, 5, -13, 1, 0, 10, -13,
+    9, 12, 10, -1, 5, -8, 10, -9, -1, 11, 1, -13, -9, -3, -6, 2,
+    -1, -10, 1, 12, -13, 1, -8, -10, 8, -11, 10, -6, 2, -13, 3, -6,
+    7, -13, 12, -9, -10, -10, -5, -7, -10, -8, -8, -13, 4, -6, 8, 5,
+    3, 12, 8, -13, -4, 2, -3, -3, 5, -13, 10, -12, 4, -13, 5, -1,
+    -9, 9, -4, 3, 0, 3, 3, -9, -12, 1, -6, 1, 3, 2, 4, -8,
+    -10, -10, -10, 9, 8, -13, 12, 12, -8, -12, -6, -5, 2, 2, 3, 7,
+    10, 6, 11, -8, 6, 8, 8, -12, -7, 10, -6, 5, -3, -9, -3, 9,
+    -1, -13, -1, 5, -3, -7, -3, 4, -8, -2, -8, 3, 4, 2, 12, 12,
+    2, -5, 3, 11, 6, -9, 11, -13, 3, -1, 7, 12, 11, -1, 12, 4,
+    -3, 0, -3, 6, 4, -11, 4, 12, 2, -4, 2, 1, -10, -6, -8, 1,
+    -13, 7, -11, 1, -13, 12, -11, -13, 6, 0, 11, -13, 0, -1, 1, 4,
+    -13, 3, -9, -2, -9, 8, -6, -3, -13, -6, -8, -2, 5, -9, 8, 10,
+    2, 7, 3, -9, -1, -6, -1, -1, 9, 5, 11, -2, 11, -3, 12, -8,
+    3, 0, 3, 5, -1, 4, 0, 10, 3, -6, 4, 5, -13, 0, -10, 5,
+    5, 8, 12, 11, 8, 9, 9, -6, 7, -4, 8, -12, -10, 4, -10, 9,
+    7, 3, 12, 4, 9, -7, 10, -2, 7, 0, 12, -2, -1, -6, 0, -11,
+};
+
+#ifdef OPENCLFAST_TRACING
+// Enqueues between two waits before pending_trace_events_ has to grow
+const size_t kPendingTraceEventsReserve = 256;
+#endif
+
+}
+
+std::vector<cl_char4> OrbPattern() {
+  std::vector<cl_char4> pattern(ORB_DESCRIPTOR_BYTES * 8);
+  for (size_t i = 0; i < pattern.size(); i++) {
+    for (int k = 0; k < 4; k++) {
+      pattern[i].s[k] = static_cast<cl_char>(kOrbBitPattern31[i * 4 + k]);
+    }
+  }
+  return pattern;
+}
+
+// Same construction as cv::ORB, which makes the circle symmetric under
+// swapping rows and columns
+std::vector<int> OrbUMax() {
+  const int half = ORB_HALF_PATCH_SIZE;
+  std::vector<int> umax(half + 2, 0);
+  int vmax = cvFloor(half * std::sqrt(2.0) / 2 + 1);
+  int vmin = cvCeil(half * std::sqrt(2.0) / 2);
+  for (int v = 0; v <= vmax; v++) {
+    umax[v] = cvRound(std::sqrt(static_cast<double>(half * half - v * v)));
+  }
+  for (int v = half, v0 = 0; v >= vmin; v--) {
+    while (umax[v0] == umax[v0 + 1]) {
+      v0++;
+    }
+    umax[v] = v0;
+    v0++;
+  }
+  umax.resize(half + 1);
+  return umax;
+}
+
 OpenCLHelper::OpenCLHelper(OpenCLDeviceType type) {
+    TRACE_SCOPE("OpenCLHelper::OpenCLHelper");
+#ifdef OPENCLFAST_TRACING
+    // Cleared, not freed, each time the events are resolved
+    pending_trace_events_.reserve(kPendingTraceEventsReserve);
+#endif
     SelectPlatform();
-    PlatformInfo(platforms_[0]);
 
-    SelectDevice(platforms_[0], type);
+    // CPU runtimes such as POCL are usually not the first platform
+    cl_platform_id platform_id = platforms_[0];
+    for (cl_platform_id candidate : platforms_) {
+      if (HasDevice(candidate, type)) {
+        platform_id = candidate;
+        break;
+      }
+    }
+    PlatformInfo(platform_id);
+
+    SelectDevice(platform_id, type);
     DeviceInfo(device_id_);
     CreateContextAndCommandQueue();
 }
 
+OpenCLHelper::~OpenCLHelper() {
+  for (const auto& entry : cached_kernels_) {
+    clReleaseKernel(entry.second);
+  }
+  for (const auto& entry : scratch_buffers_) {
+    clReleaseMemObject(entry.second.buffer);
+  }
+  for (cl_mem buffer : {scratch_image_, orb_pattern_buffer_, orb_umax_buffer_}) {
+    if (buffer != nullptr) {
+      clReleaseMemObject(buffer);
+    }
+  }
+}
+
 
 void OpenCLHelper::PlatformInfo(cl_platform_id platform_id) {
   char str_buffer[1024];
@@ -55,6 +196,16 @@ void OpenCLHelper::PlatformInfo(cl_platform_id platform_id) {
 
 }
 
+bool OpenCLHelper::HasDevice(cl_platform_id platform_id,
+                             OpenCLDeviceType device_type) {
+  cl_device_type cl_type = device_type == OpenCL::OpenCLDeviceType::CPU
+                               ? CL_DEVICE_TYPE_CPU
+                               : CL_DEVICE_TYPE_GPU;
+  cl_uint num_devices_available = 0;
+  int err = clGetDeviceIDs(platform_id, cl_type, 0, NULL, &num_devices_available);
+  return err == CL_SUCCESS && num_devices_available > 0;
+}
+
 void OpenCLHelper::SelectDevice(cl_platform_id platform_id,
                                 OpenCLDeviceType device_type) {
   cl_uint num_devices_available;
@@ -74,6 +225,7 @@ void OpenCLHelper::SelectDevice(cl_platform_id platform_id,
       err = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_CPU,
                            num_devices_available, cl_devices, NULL);
       CheckError("clGetDeviceIDs", err);
+      break;
     }
 
     case OpenCL::OpenCLDeviceType::GPU: {
@@ -83,6 +235,7 @@ void OpenCLHelper::SelectDevice(cl_platform_id platform_id,
       err = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_GPU,
                            num_devices_available, cl_devices, NULL);
       CheckError("clGetDeviceIDs", err);
+      break;
     }
   }
   device_id_ = cl_devices[0];
@@ -171,20 +324,26 @@ void OpenCLHelper::SelectPlatform() {
 
 cl_program
 OpenCLHelper::BuildProgramFromSource(const char *program_content,
-                                     size_t progmran_content_length) {
+                                     size_t progmran_content_length,
+                                     const std::string &options) {
   return BuildProgramFromSourceInternal(ctx_, device_id_, program_content,
-                                        progmran_content_length);
+                                        progmran_content_length, options);
 }
 
 cl_program OpenCLHelper::BuildProgramFromSourceInternal(
     cl_context ctx, cl_device_id device_id, const char *program_content,
-    size_t progmran_content_length) {
+    size_t progmran_content_length, const std::string &options) {
+  TRACE_SCOPE("BuildProgram");
   int err;
   cl_program program = clCreateProgramWithSource(
       ctx, 1, (const char **)&program_content,
       static_cast<const size_t *>(&progmran_content_length), &err);
   CheckError("CreateProgramWithSource", err);
-  err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+  std::string build_options = ORBBuildOptions();
+  if (!options.empty()) {
+    build_options += " " + options;
+  }
+  err = clBuildProgram(program, 0, NULL, build_options.c_str(), NULL, NULL);
   if (err != CL_SUCCESS) {
     size_t log_size;
     clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL,
@@ -201,7 +360,8 @@ cl_program OpenCLHelper::BuildProgramFromSourceInternal(
   return program;
 }
 
-cl_program OpenCLHelper::BuildProgramFromSourceFile(const std::string& file_path) {
+cl_program OpenCLHelper::BuildProgramFromSourceFile(const std::string& file_path,
+                                                    const std::string& options) {
   std::ifstream ifs(file_path);
   if (!ifs) {
     std::cerr << "Source file : " << file_path << " can't open.";
@@ -214,7 +374,7 @@ cl_program OpenCLHelper::BuildProgramFromSourceFile(const std::string& file_path
   char* buf = new char[length];
   ifs.read(buf, length);
 
-  auto program = BuildProgramFromSource(buf, length);
+  auto program = BuildProgramFromSource(buf, length, options);
 
   delete[] buf;
   return program;
@@ -226,7 +386,11 @@ void OpenCLHelper::CreateContextAndCommandQueue() {
   ctx_ = clCreateContext(NULL, 1, &device_id_, NULL, NULL, &err);
   CheckError("clCreateContext", err);
 
-  command_queue_ = clCreateCommandQueue(ctx_, device_id_, 0, &err);
+  cl_command_queue_properties properties = 0;
+#ifdef OPENCLFAST_TRACING
+  properties |= CL_QUEUE_PROFILING_ENABLE;
+#endif
+  command_queue_ = clCreateCommandQueue(ctx_, device_id_, properties, &err);
 
   CheckError("clCreateCommandQueue", err);
 }
@@ -235,7 +399,7 @@ cl_mem OpenCLHelper::CreateBufferRead(size_t memory_size_bytes) {
   cl_int err;
   cl_mem ret_mem =
       clCreateBuffer(ctx_, CL_MEM_READ_ONLY, memory_size_bytes, nullptr, &err);
-  CheckError("CreateMemoryRead", err);
+  Check("CreateMemoryRead", err);
   return ret_mem;
 }
 cl_mem OpenCLHelper::CreateBufferReadWrite(size_t memory_size_bytes) {
@@ -243,7 +407,7 @@ cl_mem OpenCLHelper::CreateBufferReadWrite(size_t memory_size_bytes) {
   cl_int err;
   cl_mem ret_mem =
       clCreateBuffer(ctx_, CL_MEM_READ_WRITE, memory_size_bytes, nullptr, &err);
-  CheckError("CreateMemoryREADWRITE", err);
+  Check("CreateMemoryREADWRITE", err);
   return ret_mem;
 }
 
@@ -261,30 +425,73 @@ cl_mem OpenCLHelper::CreateOpenCLImage2D(size_t width, size_t height, ImageForma
 
   }
 
-  cl_mem ret_mem = clCreateImage2D(ctx_, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, &opencl_image_format,
+  cl_mem_flags flags = CL_MEM_READ_ONLY;
+  if (host_ptr != nullptr) {
+    flags |= CL_MEM_COPY_HOST_PTR;
+  }
+  cl_mem ret_mem = clCreateImage2D(ctx_, flags, &opencl_image_format,
                                    width, height, 0, host_ptr, &error);
-  CheckError("CreateImage2D", error);
+  Check("CreateImage2D", error);
   return ret_mem;
 }
 
 void OpenCLHelper::CopyFromHost(cl_mem device_memory, void *host_ptr,
                                 size_t host_ptr_length) {
   int error = clEnqueueWriteBuffer(command_queue_, device_memory, CL_TRUE, 0,
-                                   host_ptr_length, host_ptr, 0, NULL, NULL);
+                                   host_ptr_length, host_ptr, 0, NULL,
+                                   TraceEvent("CopyFromHost"));
+  Check("EnqueueWriteBuffer", error);
+  ResolveTraceEvents();
 }
 
 void OpenCLHelper::CopyToHost(cl_mem device_memory, void *host_ptr,
                               size_t host_ptr_length) {
 
   int error = clEnqueueReadBuffer(command_queue_, device_memory, CL_TRUE, 0,
-                                  host_ptr_length, host_ptr, 0, NULL, NULL);
+                                  host_ptr_length, host_ptr, 0, NULL,
+                                  TraceEvent("CopyToHost"));
+  Check("EnqueueReadBuffer", error);
+  ResolveTraceEvents();
+}
+
+void OpenCLHelper::CopyFromHostAsync(cl_mem device_memory, const void *host_ptr,
+                                     size_t host_ptr_length) {
+  int error = clEnqueueWriteBuffer(command_queue_, device_memory, CL_FALSE, 0,
+                                   host_ptr_length, host_ptr, 0, NULL,
+                                   TraceEvent("CopyFromHostAsync"));
+  Check("EnqueueWriteBuffer", error);
+}
+
+void OpenCLHelper::CopyToHostAsync(cl_mem device_memory, void *host_ptr,
+                                   size_t host_ptr_length) {
+  int error = clEnqueueReadBuffer(command_queue_, device_memory, CL_FALSE, 0,
+                                  host_ptr_length, host_ptr, 0, NULL,
+                                  TraceEvent("CopyToHostAsync"));
+  Check("EnqueueReadBuffer", error);
+}
+
+void OpenCLHelper::CopyImage2DFromHostAsync(cl_mem image, size_t width,
+                                            size_t height, const void *host_ptr) {
+  size_t origin[3] = {0, 0, 0};
+  size_t region[3] = {width, height, 1};
+  int error = clEnqueueWriteImage(command_queue_, image, CL_FALSE, origin,
+                                  region, 0, 0, host_ptr, 0, NULL,
+                                  TraceEvent("CopyImage2DFromHostAsync"));
+  Check("EnqueueWriteImage", error);
 }
 
 cl_kernel OpenCLHelper::CreateKernel(cl_program program, const std::string& kernel_function_name) {
   int error;
 
   cl_kernel kernel = clCreateKernel(program, kernel_function_name.c_str(), &error);
-  CheckError("CreateKernel", error);
+  Check("CreateKernel", error);
+#ifdef OPENCLFAST_TRACING
+  // A released kernel's handle can come back for another function, so always
+  // overwrite
+  if (kernel != NULL) {
+    kernel_trace_names_[kernel] = trace::InternName(kernel_function_name);
+  }
+#endif
   return kernel;
 }
 
@@ -295,8 +502,386 @@ void OpenCLHelper::KernelRun(cl_kernel kernel, size_t global_group_x, size_t glo
     //cl_event kernel_event;
     // Enqueue kernel
     int err = clEnqueueNDRangeKernel(command_queue_, kernel, 3, NULL,
-                                     global_sizes, NULL, 0, NULL, NULL);
-    CheckError("EnqueueNDRangeKernel", err);
+                                     global_sizes, NULL, 0, NULL,
+                                     TraceEvent(NULL, kernel));
+    Check("EnqueueNDRangeKernel", err);
+}
+
+cl_mem OpenCLHelper::CreateFASTInput(FASTKernelVariant variant, size_t width,
+                                     size_t height, const void *host_ptr) {
+  if (variant == FASTKernelVariant::Image2D) {
+    return CreateOpenCLImage2D(width, height, ImageFormat::GrayUInt8,
+                               const_cast<void *>(host_ptr));
+  }
+  cl_mem buffer = CreateBufferRead(width * height);
+  CopyFromHost(buffer, const_cast<void *>(host_ptr), width * height);
+  return buffer;
+}
+
+cl_kernel OpenCLHelper::CreateFASTKernel(cl_program program, FASTKernelVariant variant) {
+  return CreateKernel(program, variant == FASTKernelVariant::Image2D
+                                   ? "FASTCorner"
+                                   : "FASTCornerBuffer");
+}
+
+void OpenCLHelper::RunFAST(cl_program program, FASTKernelVariant variant,
+                           cl_mem input, cl_mem output, size_t width,
+                           size_t height, int threshold) {
+  cl_kernel kernel = CreateFASTKernel(program, variant);
+  RunFAST(kernel, variant, input, output, width, height, threshold);
+  // The queue keeps the kernel alive until the launch has run
+  clReleaseKernel(kernel);
+}
+
+void OpenCLHelper::RunFAST(cl_kernel kernel, FASTKernelVariant variant,
+                           cl_mem input, cl_mem output, size_t width,
+                           size_t height, int threshold) {
+  if (variant == FASTKernelVariant::Image2D) {
+    KernelBindArgs(kernel, input, output, threshold);
+    KernelRun(kernel, width, height, 1);
+  } else {
+    size_t pixels_per_item = static_cast<size_t>(variant);
+    KernelBindArgs(kernel, input, output, static_cast<int>(width),
+                   static_cast<int>(height), threshold);
+    KernelRun(kernel, (width + pixels_per_item - 1) / pixels_per_item, height, 1);
+  }
+}
+
+void OpenCLHelper::Finish() {
+  int err = clFinish(command_queue_);
+  Check("clFinish", err);
+  ResolveTraceEvents();
+}
+
+void OpenCLHelper::SetExitOnError(bool exit_on_error) {
+  exit_on_error_ = exit_on_error;
+}
+
+cl_int OpenCLHelper::TakeError() {
+  cl_int error = first_error_;
+  first_error_ = CL_SUCCESS;
+  return error;
+}
+
+void OpenCLHelper::Check(const std::string& tag, cl_int error_code) {
+  if (error_code == CL_SUCCESS) {
+    return;
+  }
+  if (exit_on_error_) {
+    CheckError(tag, error_code);
+  }
+  std::cerr << tag << " error " << error_code << std::endl;
+  if (first_error_ == CL_SUCCESS) {
+    first_error_ = error_code;
+  }
+}
+
+DeviceLimits OpenCLHelper::GetDeviceLimits() {
+  DeviceLimits limits;
+  int err = clGetDeviceInfo(device_id_, CL_DEVICE_IMAGE2D_MAX_WIDTH,
+                            sizeof(limits.image2d_max_width),
+                            &limits.image2d_max_width, NULL);
+  Check("clGetDeviceInfo", err);
+  err = clGetDeviceInfo(device_id_, CL_DEVICE_IMAGE2D_MAX_HEIGHT,
+                        sizeof(limits.image2d_max_height),
+                        &limits.image2d_max_height, NULL);
+  Check("clGetDeviceInfo", err);
+  err = clGetDeviceInfo(device_id_, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+                        sizeof(limits.max_mem_alloc_size),
+                        &limits.max_mem_alloc_size, NULL);
+  Check("clGetDeviceInfo", err);
+  return limits;
+}
+
+cl_event* OpenCLHelper::TraceEvent([[maybe_unused]] const char* name,
+                                   [[maybe_unused]] cl_kernel kernel) {
+#ifdef OPENCLFAST_TRACING
+  const char* event_name = name ? name : "";
+  if (kernel != NULL) {
+    auto found = kernel_trace_names_.find(kernel);
+    event_name = found != kernel_trace_names_.end() ? found->second : "kernel";
+  }
+  pending_trace_events_.push_back({event_name, trace::NowNs(), NULL});
+  return &pending_trace_events_.back().event;
+#else
+  return NULL;
+#endif
+}
+
+void OpenCLHelper::ResolveTraceEvents() {
+#ifdef OPENCLFAST_TRACING
+  // Device timestamps are on the device clock, anchor each event at the host
+  // time it was enqueued and keep the device side deltas
+  for (const PendingTraceEvent& pending : pending_trace_events_) {
+    cl_ulong queued = 0, start = 0, end = 0;
+    if (pending.event == NULL) {
+      continue;
+    }
+    if (clGetEventProfilingInfo(pending.event, CL_PROFILING_COMMAND_QUEUED,
+                                sizeof(queued), &queued, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(pending.event, CL_PROFILING_COMMAND_START,
+                                sizeof(start), &start, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(pending.event, CL_PROFILING_COMMAND_END,
+                                sizeof(end), &end, NULL) == CL_SUCCESS &&
+        start >= queued && end >= start) {
+      trace::RecordDeviceSpan(pending.name,
+                              pending.host_enqueue_ns + (start - queued),
+                              end - start);
+    }
+    clReleaseEvent(pending.event);
+  }
+  pending_trace_events_.clear();
+#endif
+}
+
+cl_kernel OpenCLHelper::CachedKernel(cl_program program, const char* kernel_function_name) {
+  cl_kernel& kernel = cached_kernels_[std::make_pair(program, std::string(kernel_function_name))];
+  if (kernel == nullptr) {
+    kernel = CreateKernel(program, kernel_function_name);
+  }
+  return kernel;
+}
+
+cl_mem OpenCLHelper::ScratchBuffer(const char* name, size_t size_bytes) {
+  Scratch& scratch = scratch_buffers_[name];
+  if (scratch.size_bytes < size_bytes) {
+    if (scratch.buffer != nullptr) {
+      clReleaseMemObject(scratch.buffer);
+    }
+    scratch.buffer = CreateBufferReadWrite(size_bytes);
+    scratch.size_bytes = scratch.buffer != nullptr ? size_bytes : 0;
+  }
+  return scratch.buffer;
+}
+
+cl_mem OpenCLHelper::ScratchImage(size_t width, size_t height) {
+  if (scratch_image_ == nullptr || scratch_image_width_ != width || scratch_image_height_ != height) {
+    if (scratch_image_ != nullptr) {
+      clReleaseMemObject(scratch_image_);
+    }
+    scratch_image_ = CreateOpenCLImage2D(width, height, ImageFormat::GrayUInt8, nullptr);
+    scratch_image_width_ = scratch_image_ != nullptr ? width : 0;
+    scratch_image_height_ = scratch_image_ != nullptr ? height : 0;
+  }
+  return scratch_image_;
+}
+
+void OpenCLHelper::UploadORBTables() {
+  if (orb_pattern_buffer_ == nullptr) {
+    std::vector<cl_char4> pattern = OrbPattern();
+    orb_pattern_buffer_ = CreateBufferRead(pattern.size() * sizeof(cl_char4));
+    CopyFromHost(orb_pattern_buffer_, pattern.data(), pattern.size() * sizeof(cl_char4));
+  }
+  if (orb_umax_buffer_ == nullptr) {
+    std::vector<int> half_widths = OrbUMax();
+    std::vector<cl_int> umax(half_widths.begin(), half_widths.end());
+    orb_umax_buffer_ = CreateBufferRead(umax.size() * sizeof(cl_int));
+    CopyFromHost(orb_umax_buffer_, umax.data(), umax.size() * sizeof(cl_int));
+  }
+}
+
+void OpenCLHelper::DetectAndDescribe(cl_program program, const cv::Mat& gray_image, int threshold,
+                                     std::vector<cv::KeyPoint>* keypoints, cv::Mat* descriptors,
+                                     int max_keypoints) {
+  static const cl_int zero = 0;
+  keypoints->clear();
+  *descriptors = cv::Mat();
+  if (gray_image.type() != CV_8UC1) {
+    Check("DetectAndDescribe: gray_image must be CV_8UC1", CL_INVALID_VALUE);
+    return;
+  }
+
+  cv::Mat image = gray_image.isContinuous() ? gray_image : gray_image.clone();
+  size_t image_width = image.cols;
+  size_t image_height = image.rows;
+  size_t image_size = image_width * image_height;
+  // One histogram cell over the whole frame for the max_keypoints cutoff
+  int cell_size = std::max(image.cols, image.rows);
+
+  UploadORBTables();
+  cl_mem image_buffer = ScratchImage(image_width, image_height);
+  cl_mem corner_buffer = ScratchBuffer("corner", image_size);
+  cl_mem nms_buffer = ScratchBuffer("nms", image_size);
+  cl_mem blurred_buffer = ScratchBuffer("blurred", image_size);
+  cl_mem histogram_buffer = ScratchBuffer("histogram", 256 * sizeof(cl_uint));
+  cl_mem cutoff_buffer = ScratchBuffer("cutoff", sizeof(cl_uchar));
+  cl_mem count_buffer = ScratchBuffer("count", sizeof(cl_int));
+  cl_mem keypoint_buffer = ScratchBuffer("keypoints", max_keypoints * sizeof(cl_int2));
+  cl_mem score_buffer = ScratchBuffer("scores", max_keypoints);
+  cl_mem record_buffer = ScratchBuffer("orb_records", max_keypoints * sizeof(ORBKeypointRecord));
+  cl_mem descriptor_buffer = ScratchBuffer("orb_descriptors", max_keypoints * ORB_DESCRIPTOR_BYTES);
+
+  CopyImage2DFromHostAsync(image_buffer, image_width, image_height, image.data);
+  CopyFromHostAsync(count_buffer, &zero, sizeof(zero));
+  cl_kernel zero_kernel = CachedKernel(program, "ZeroBuffer");
+  KernelBindArgs(zero_kernel, histogram_buffer);
+  KernelRun(zero_kernel, 256, 1, 1);
+
+  cl_kernel fast_kernel = CachedKernel(program, "FASTCorner");
+  KernelBindArgs(fast_kernel, image_buffer, corner_buffer, threshold);
+  KernelRun(fast_kernel, image_width, image_height, 1);
+
+  cl_kernel nms_kernel = CachedKernel(program, "NonMaximumSuppression");
+  KernelBindArgs(nms_kernel, corner_buffer, nms_buffer, 3);
+  KernelRun(nms_kernel, image_width, image_height, 1);
+
+  // Which responses make it into a full keypoint list depends on the atomic
+  // order, so drop everything below the lowest score that keeps at most
+  // max_keypoints before compacting. The cutoff is picked on the device and
+  // costs no round trip.
+  cl_kernel histogram_kernel = CachedKernel(program, "ScoreHistogram");
+  KernelBindArgs(histogram_kernel, nms_buffer, histogram_buffer, cell_size, 1);
+  KernelRun(histogram_kernel, image_width, image_height, 1);
+
+  cl_kernel cutoff_kernel = CachedKernel(program, "SelectScoreCutoff");
+  KernelBindArgs(cutoff_kernel, histogram_buffer, cutoff_buffer, max_keypoints);
+  KernelRun(cutoff_kernel, 1, 1, 1);
+
+  cl_kernel apply_kernel = CachedKernel(program, "ApplyCellThreshold");
+  KernelBindArgs(apply_kernel, nms_buffer, cutoff_buffer, cell_size, 1);
+  KernelRun(apply_kernel, image_width, image_height, 1);
+
+  cl_kernel compact_kernel = CachedKernel(program, "CompactKeypoints");
+  KernelBindArgs(compact_kernel, nms_buffer, count_buffer, keypoint_buffer,
+                 score_buffer, max_keypoints, ORB_HALF_PATCH_SIZE);
+  KernelRun(compact_kernel, image_width, image_height, 1);
+
+  // Orientation and descriptors run over every keypoint slot and skip the
+  // ones past the count, so they are queued before the host knows it
+  cl_kernel blur_kernel = CachedKernel(program, "ORBBlur");
+  KernelBindArgs(blur_kernel, image_buffer, blurred_buffer);
+  KernelRun(blur_kernel, image_width, image_height, 1);
+
+  cl_kernel orientation_kernel = CachedKernel(program, "ORBOrientation");
+  KernelBindArgs(orientation_kernel, image_buffer, orb_umax_buffer_, count_buffer, max_keypoints,
+                 keypoint_buffer, score_buffer, record_buffer);
+  KernelRun(orientation_kernel, max_keypoints, 1, 1);
+
+  cl_kernel descriptor_kernel = CachedKernel(program, "ORBDescriptor");
+  KernelBindArgs(descriptor_kernel, blurred_buffer, static_cast<int>(image_width),
+                 static_cast<int>(image_height), count_buffer, max_keypoints, record_buffer,
+                 orb_pattern_buffer_, descriptor_buffer);
+  KernelRun(descriptor_kernel, max_keypoints, 1, 1);
+
+  cl_int keypoint_count = 0;
+  CopyToHostAsync(count_buffer, &keypoint_count, sizeof(keypoint_count));
+  Finish();
+  size_t n = std::min(std::max(keypoint_count, 0), max_keypoints);
+  if (n == 0) {
+    return;
+  }
+
+  std::vector<ORBKeypointRecord> records(n);
+  cv::Mat compacted_descriptors(n, ORB_DESCRIPTOR_BYTES, CV_8UC1);
+  CopyToHostAsync(record_buffer, records.data(), n * sizeof(ORBKeypointRecord));
+  CopyToHostAsync(descriptor_buffer, compacted_descriptors.data, n * ORB_DESCRIPTOR_BYTES);
+  Finish();
+
+  // Compaction order is arbitrary, strongest first and then raster order
+  std::vector<size_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (records[a].score != records[b].score) {
+      return records[a].score > records[b].score;
+    }
+    if (records[a].y != records[b].y) {
+      return records[a].y < records[b].y;
+    }
+    return records[a].x < records[b].x;
+  });
+
+  descriptors->create(n, ORB_DESCRIPTOR_BYTES, CV_8UC1);
+  keypoints->reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    const ORBKeypointRecord& record = records[order[i]];
+    float angle = record.angle * static_cast<float>(180.0 / CV_PI);
+    if (angle < 0) {
+      angle += 360.0f;
+    }
+    keypoints->push_back(cv::KeyPoint(record.x, record.y, 2 * ORB_HALF_PATCH_SIZE + 1, angle,
+                                      record.score));
+    std::memcpy(descriptors->ptr(i), compacted_descriptors.ptr(order[i]), ORB_DESCRIPTOR_BYTES);
+  }
+}
+
+void OpenCLHelper::FASTAdaptive(cl_program program, const cv::Mat& gray_image,
+                                AdaptiveCandidateTarget* controller,
+                                std::vector<cv::KeyPoint>* keypoints, int cell_size) {
+  keypoints->clear();
+  if (gray_image.type() != CV_8UC1) {
+    Check("FASTAdaptive: gray_image must be CV_8UC1", CL_INVALID_VALUE);
+    return;
+  }
+
+  cv::Mat image = gray_image.isContinuous() ? gray_image : gray_image.clone();
+  size_t image_width = image.cols;
+  size_t image_height = image.rows;
+  int cells_x = (image.cols + cell_size - 1) / cell_size;
+  int cells_y = (image.rows + cell_size - 1) / cell_size;
+  int cell_count = cells_x * cells_y;
+  int max_keypoints = std::max(4 * controller->TargetKeypoints(), 1024);
+
+  static const cl_int zero = 0;
+  cl_mem image_buffer = ScratchImage(image_width, image_height);
+  cl_mem corner_buffer = ScratchBuffer("corner", image_width * image_height);
+  cl_mem nms_buffer = ScratchBuffer("nms", image_width * image_height);
+  cl_mem histogram_buffer = ScratchBuffer("histogram", cell_count * 256 * sizeof(cl_uint));
+  cl_mem cell_threshold_buffer = ScratchBuffer("cell_thresholds", cell_count);
+  cl_mem count_buffer = ScratchBuffer("count", sizeof(cl_int));
+  cl_mem keypoint_buffer = ScratchBuffer("keypoints", max_keypoints * sizeof(cl_int2));
+  cl_mem score_buffer = ScratchBuffer("scores", max_keypoints);
+
+  CopyImage2DFromHostAsync(image_buffer, image_width, image_height, image.data);
+  CopyFromHostAsync(count_buffer, &zero, sizeof(zero));
+  cl_kernel zero_kernel = CachedKernel(program, "ZeroBuffer");
+  KernelBindArgs(zero_kernel, histogram_buffer);
+  KernelRun(zero_kernel, cell_count * 256, 1, 1);
+
+  // Score once at the floor threshold, the per-cell thresholds only prune
+  cl_kernel fast_kernel = CachedKernel(program, "FASTCorner");
+  KernelBindArgs(fast_kernel, image_buffer, corner_buffer, controller->MinThreshold());
+  KernelRun(fast_kernel, image_width, image_height, 1);
+
+  cl_kernel histogram_kernel = CachedKernel(program, "ScoreHistogram");
+  KernelBindArgs(histogram_kernel, corner_buffer, histogram_buffer, cell_size, cells_x);
+  KernelRun(histogram_kernel, image_width, image_height, 1);
+
+  cl_kernel select_kernel = CachedKernel(program, "SelectCellThreshold");
+  KernelBindArgs(select_kernel, histogram_buffer, cell_threshold_buffer,
+                 controller->CandidateTarget(), controller->MinThreshold());
+  KernelRun(select_kernel, cell_count, 1, 1);
+
+  cl_kernel apply_kernel = CachedKernel(program, "ApplyCellThreshold");
+  KernelBindArgs(apply_kernel, corner_buffer, cell_threshold_buffer, cell_size, cells_x);
+  KernelRun(apply_kernel, image_width, image_height, 1);
+
+  cl_kernel nms_kernel = CachedKernel(program, "NonMaximumSuppression");
+  KernelBindArgs(nms_kernel, corner_buffer, nms_buffer, 3);
+  KernelRun(nms_kernel, image_width, image_height, 1);
+
+  cl_kernel compact_kernel = CachedKernel(program, "CompactKeypoints");
+  KernelBindArgs(compact_kernel, nms_buffer, count_buffer, keypoint_buffer,
+                 score_buffer, max_keypoints, 3);
+  KernelRun(compact_kernel, image_width, image_height, 1);
+
+  cl_int keypoint_count = 0;
+  CopyToHostAsync(count_buffer, &keypoint_count, sizeof(keypoint_count));
+  Finish();
+  size_t n = std::min(std::max(keypoint_count, 0), max_keypoints);
+
+  std::vector<cl_int2> positions(n);
+  std::vector<uchar> scores(n);
+  if (n > 0) {
+    CopyToHostAsync(keypoint_buffer, positions.data(), n * sizeof(cl_int2));
+    CopyToHostAsync(score_buffer, scores.data(), n);
+    Finish();
+  }
+
+  keypoints->reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    keypoints->push_back(cv::KeyPoint(positions[i].s[0], positions[i].s[1], 3, -1, scores[i]));
+  }
+  controller->Update(keypoint_count);
 }
 
-}
\ No newline at end of file
+}
@@ -1,3 +1,6 @@
+#ifndef OPENCL_HELPER_H
+#define OPENCL_HELPER_H
+
 #define CL_TARGET_OPENCL_VERSION 110
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
@@ -7,10 +10,13 @@
 #error "Unsupported platform"
 #endif
 
+#include <map>
 #include <vector>
 #include <string>
 #include "iostream"
 #include <opencv2/opencv.hpp>
+#include "adaptive_threshold.h"
+#include "trace.h"
 namespace {
 
 void CheckError(std::string tag, int error_code) {
@@ -23,6 +29,33 @@ void CheckError(std::string tag, int error_code) {
 }
 namespace OpenCL {
 
+constexpr int ORB_HALF_PATCH_SIZE = 15;
+constexpr int ORB_DESCRIPTOR_BYTES = 32;
+
+// Host constants the kernels in fast.cl are compiled against, every program
+// built by OpenCLHelper gets these ahead of the caller's options
+inline std::string ORBBuildOptions() {
+  return "-D ORB_HALF_PATCH_SIZE=" + std::to_string(ORB_HALF_PATCH_SIZE) +
+         " -D ORB_DESCRIPTOR_BYTES=" + std::to_string(ORB_DESCRIPTOR_BYTES);
+}
+
+// cv::ORB's learned rBRIEF test pairs (x1, y1, x2, y2), as DetectAndDescribe
+// hands them to ORBDescriptor
+std::vector<cl_char4> OrbPattern();
+// Half width of each row of cv::ORB's circular orientation patch, indexed by
+// the distance from the centre row
+std::vector<int> OrbUMax();
+
+// ORBKeypoint in fast.cl, DetectAndDescribe reads back one per keypoint next
+// to its descriptor. angle is in radians.
+struct ORBKeypointRecord {
+  cl_int x;
+  cl_int y;
+  cl_float angle;
+  cl_int score;
+};
+static_assert(sizeof(ORBKeypointRecord) == 16, "ORBKeypointRecord must match ORBKeypoint in fast.cl");
+
 enum OpenCLDeviceType {
     CPU = 0,
     GPU = 1,
@@ -33,37 +66,153 @@ enum ImageFormat {
   GrayUInt8 = 0,
 };
 
+// Which FAST kernel scores the image. The buffer variants run FASTCornerBuffer
+// with the value as the number of pixels per work item.
+enum FASTKernelVariant {
+  Image2D = 0,
+  Buffer4 = 4,
+  Buffer8 = 8,
+  Buffer16 = 16,
+};
+
+inline std::string FASTBuildOptions(FASTKernelVariant variant) {
+  if (variant == FASTKernelVariant::Image2D) {
+    return "";
+  }
+  return "-D FAST_VECTOR_WIDTH=" + std::to_string(static_cast<int>(variant));
+}
+
+struct FASTKernelVariantInfo {
+  FASTKernelVariant variant;
+  const char* name;
+};
+
+// Every variant with its command line name, the image2d reference first
+constexpr FASTKernelVariantInfo FAST_KERNEL_VARIANTS[] = {
+    {FASTKernelVariant::Image2D, "image2d"},
+    {FASTKernelVariant::Buffer4, "buffer4"},
+    {FASTKernelVariant::Buffer8, "buffer8"},
+    {FASTKernelVariant::Buffer16, "buffer16"},
+};
+
+inline const char* FASTKernelVariantName(FASTKernelVariant variant) {
+  for (const FASTKernelVariantInfo& info : FAST_KERNEL_VARIANTS) {
+    if (info.variant == variant) {
+      return info.name;
+    }
+  }
+  return "unknown";
+}
+
+inline bool ParseFASTKernelVariant(const std::string& name, FASTKernelVariant* variant) {
+  for (const FASTKernelVariantInfo& info : FAST_KERNEL_VARIANTS) {
+    if (name == info.name) {
+      *variant = info.variant;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Device limits a caller has to respect when sizing images and buffers
+struct DeviceLimits {
+  size_t image2d_max_width = 0;
+  size_t image2d_max_height = 0;
+  cl_ulong max_mem_alloc_size = 0;
+};
+
 class OpenCLHelper {
 public:
     explicit OpenCLHelper(OpenCLDeviceType = OpenCLDeviceType::GPU);
+    ~OpenCLHelper();
 
-    cl_program BuildProgramFromSource(const char* program_content, size_t progmran_content_length);
-    cl_program BuildProgramFromSourceFile(const std::string& file_path);
+    OpenCLHelper(const OpenCLHelper&) = delete;
+    OpenCLHelper& operator=(const OpenCLHelper&) = delete;
+
+    // options are passed to clBuildProgram after ORBBuildOptions(), e.g. FASTBuildOptions(variant)
+    cl_program BuildProgramFromSource(const char* program_content, size_t progmran_content_length,
+                                      const std::string& options = "");
+    cl_program BuildProgramFromSourceFile(const std::string& file_path, const std::string& options = "");
 
     cl_mem CreateBufferRead(size_t memory_size_bytes);
     cl_mem CreateBufferReadWrite(size_t memory_size_bytes);
     // host_ptr should contains width * height * sizeof(ImageFormat data size)
+    // or be nullptr to leave the image uninitialized
     cl_mem CreateOpenCLImage2D(size_t width, size_t height, ImageFormat image_format, void* host_ptr);
 
     void CopyFromHost(cl_mem device_memory, void* host_ptr, size_t host_ptr_length);
     void CopyToHost(cl_mem device_memory, void* host_ptr, size_t host_ptr_length);
 
+    // Non-blocking variants, host_ptr has to stay valid until Finish()
+    void CopyFromHostAsync(cl_mem device_memory, const void* host_ptr, size_t host_ptr_length);
+    void CopyToHostAsync(cl_mem device_memory, void* host_ptr, size_t host_ptr_length);
+    void CopyImage2DFromHostAsync(cl_mem image, size_t width, size_t height, const void* host_ptr);
+
     cl_kernel CreateKernel(cl_program program, const std::string& kernel_function_name);
 
     template<class... ARGS>
     void KernelBindArgs(cl_kernel kernel, ARGS... args) {
       int arg_index = 0;
-      (CheckError("KernelSetArg_" + std::to_string(arg_index),
+      (Check("KernelSetArg_" + std::to_string(arg_index),
                   clSetKernelArg(kernel, arg_index++, sizeof(args), &args)),
        ...);
     }
 
     void KernelRun(cl_kernel kernel, size_t global_group_x, size_t global_group_y, size_t global_group_z);
 
+    // Input for RunFAST holding a copy of host_ptr: an image for Image2D, a
+    // plain buffer for the buffer variants
+    cl_mem CreateFASTInput(FASTKernelVariant variant, size_t width, size_t height, const void* host_ptr);
+
+    // FAST scores of the width x height input into output, without waiting for
+    // the device. program must be built with FASTBuildOptions(variant).
+    void RunFAST(cl_program program, FASTKernelVariant variant, cl_mem input, cl_mem output,
+                 size_t width, size_t height, int threshold);
+    // Same with a kernel from CreateFASTKernel, for callers launching it repeatedly
+    cl_kernel CreateFASTKernel(cl_program program, FASTKernelVariant variant);
+    void RunFAST(cl_kernel kernel, FASTKernelVariant variant, cl_mem input, cl_mem output,
+                 size_t width, size_t height, int threshold);
+
+    // Blocks until every command enqueued so far has completed
+    void Finish();
+
+    // A limit that can't be queried is left at zero
+    DeviceLimits GetDeviceLimits();
+
+    // By default any failing OpenCL call from the methods above ends the
+    // process. A long running caller can turn that off: the failing call then
+    // logs, returns a null object where it creates one, and the first error is
+    // kept until TakeError() returns and clears it.
+    void SetExitOnError(bool exit_on_error);
+    cl_int TakeError();
+
+    // FAST + NMS followed by cv::ORB's orientation and rBRIEF descriptors, all
+    // on the device, so the descriptors can be matched against cv::ORB ones.
+    // The host waits twice: for the keypoint count, then for one packed record
+    // per keypoint and the 32-byte descriptors; descriptors row i belongs to
+    // keypoints[i]. Keypoints are ordered by descending score. When more than
+    // max_keypoints survive NMS only the strongest are kept, responses tied at
+    // the cutoff score are dropped together so fewer than max_keypoints may come
+    // back. gray_image must be CV_8UC1. Kernels and buffers are kept for the
+    // next call.
+    void DetectAndDescribe(cl_program program, const cv::Mat& gray_image, int threshold,
+                           std::vector<cv::KeyPoint>* keypoints, cv::Mat* descriptors,
+                           int max_keypoints = 10000);
+
+    // FAST + NMS where each cell_size x cell_size cell gets its own threshold,
+    // picked on the device from a score histogram so the frame yields about
+    // controller->TargetKeypoints() keypoints. The controller is updated with
+    // the resulting count, reuse it across frames of one stream: the first
+    // frames overshoot until it has learned how much NMS removes. gray_image
+    // must be CV_8UC1. Kernels and buffers are kept for the next frame.
+    void FASTAdaptive(cl_program program, const cv::Mat& gray_image, AdaptiveCandidateTarget* controller,
+                      std::vector<cv::KeyPoint>* keypoints, int cell_size = 64);
+
 private:
     void SelectPlatform();
     void PlatformInfo(cl_platform_id platform_id);
 
+    bool HasDevice(cl_platform_id platform_id, OpenCLDeviceType device_type);
     void SelectDevice(cl_platform_id platform_id, OpenCLDeviceType device_type);
 
     void DeviceInfo(cl_device_id device_id);
@@ -71,12 +220,57 @@ private:
     void CreateContextAndCommandQueue();
 
 
-    cl_program BuildProgramFromSourceInternal(cl_context ctx, cl_device_id device_id, const char* program_content, size_t progmran_content_length);
+    void Check(const std::string& tag, cl_int error_code);
+
+    // Kernels and device buffers DetectAndDescribe and FASTAdaptive reuse from
+    // frame to frame. Kernels are kept per program and name, which stays valid
+    // since a kernel holds a reference to its program. Buffers are kept per
+    // name and only reallocated when a frame needs more room.
+    cl_kernel CachedKernel(cl_program program, const char* kernel_function_name);
+    cl_mem ScratchBuffer(const char* name, size_t size_bytes);
+    cl_mem ScratchImage(size_t width, size_t height);
+    void UploadORBTables();
+
+    cl_program BuildProgramFromSourceInternal(cl_context ctx, cl_device_id device_id, const char* program_content, size_t progmran_content_length, const std::string& options);
+
+    // Event to pass to an enqueue call so its device time shows up in the trace.
+    // NULL, i.e. no event, unless tracing is compiled in. kernel names the span
+    // after the kernel function instead of name.
+    cl_event* TraceEvent(const char* name, cl_kernel kernel = NULL);
+    // Turns the recorded events into device spans, call once the queue is drained
+    void ResolveTraceEvents();
+
+#ifdef OPENCLFAST_TRACING
+    struct PendingTraceEvent {
+      const char* name;
+      uint64_t host_enqueue_ns;
+      cl_event event;
+    };
+    std::vector<PendingTraceEvent> pending_trace_events_;
+    // Function name of every kernel from CreateKernel, interned once there so
+    // KernelRun doesn't query it or lock the trace registry
+    std::map<cl_kernel, const char*> kernel_trace_names_;
+#endif
 
     std::vector<cl_platform_id> platforms_;
     cl_device_id device_id_;
     cl_context ctx_;
     cl_command_queue command_queue_;
+
+    bool exit_on_error_ = true;
+    cl_int first_error_ = CL_SUCCESS;
+
+    struct Scratch {
+      cl_mem buffer = nullptr;
+      size_t size_bytes = 0;
+    };
+    std::map<std::pair<cl_program, std::string>, cl_kernel> cached_kernels_;
+    std::map<std::string, Scratch> scratch_buffers_;
+    cl_mem scratch_image_ = nullptr;
+    size_t scratch_image_width_ = 0;
+    size_t scratch_image_height_ = 0;
+    cl_mem orb_pattern_buffer_ = nullptr;
+    cl_mem orb_umax_buffer_ = nullptr;
 };
 
 namespace {
@@ -93,26 +287,33 @@ char PROGRAM_CONTEXT[] = "\n"
 char* KERNEL_FUNC = "TwoSum";
 }
 
-inline void OpenCLFast(cv::Mat img, std::string program_source_file, std::string output_file) {
+// The demo functions below share one helper and one program, built with
+// FASTBuildOptions(variant) for OpenCLFast. Every program has all kernels.
+inline void OpenCLFast(OpenCLHelper& opencl_helper, cl_program program, cv::Mat img,
+                       std::string output_file,
+                       FASTKernelVariant variant = FASTKernelVariant::Image2D) {
   size_t image_width = img.cols;
   size_t image_height = img.rows;
   char* gray_image_data = new char[image_width * image_height];
-  std::memcpy(gray_image_data, img.data, image_width * image_height);
-
-  OpenCL::OpenCLHelper opencl_helper;
-  auto program = opencl_helper.BuildProgramFromSourceFile(program_source_file);
+  {
+    TRACE_SCOPE("staging_memcpy");
+    std::memcpy(gray_image_data, img.data, image_width * image_height);
+  }
 
   auto total_start_time = std::chrono::high_resolution_clock::now();
 
   // Create input image and output buffers
   auto mem_h2d_start = std::chrono::high_resolution_clock::now();
   
-  cl_mem image_buffer = opencl_helper.CreateOpenCLImage2D(
-      image_width, image_height, OpenCL::ImageFormat::GrayUInt8,
-      gray_image_data);
-
-  cl_mem corner_buffer = opencl_helper.CreateBufferReadWrite(image_width * image_height);
-  cl_mem nms_buffer = opencl_helper.CreateBufferReadWrite(image_width * image_height);
+  cl_mem image_buffer;
+  cl_mem corner_buffer;
+  cl_mem nms_buffer;
+  {
+    TRACE_SCOPE("upload_image");
+    image_buffer = opencl_helper.CreateFASTInput(variant, image_width, image_height, gray_image_data);
+    corner_buffer = opencl_helper.CreateBufferReadWrite(image_width * image_height);
+    nms_buffer = opencl_helper.CreateBufferReadWrite(image_width * image_height);
+  }
   
   auto mem_h2d_end = std::chrono::high_resolution_clock::now();
   auto mem_h2d_duration = std::chrono::duration_cast<std::chrono::milliseconds>(mem_h2d_end - mem_h2d_start);
@@ -120,9 +321,10 @@ inline void OpenCLFast(cv::Mat img, std::string program_source_file, std::string
   // Run FAST corner detection
   auto fast_start_time = std::chrono::high_resolution_clock::now();
   
-  auto fast_kernel = opencl_helper.CreateKernel(program, "FASTCorner");
-  opencl_helper.KernelBindArgs(fast_kernel, image_buffer, corner_buffer, 10);
-  opencl_helper.KernelRun(fast_kernel, image_width, image_height, 1);
+  {
+    TRACE_SCOPE("enqueue_fast");
+    opencl_helper.RunFAST(program, variant, image_buffer, corner_buffer, image_width, image_height, 10);
+  }
   
   auto fast_end_time = std::chrono::high_resolution_clock::now();
   auto fast_duration = std::chrono::duration_cast<std::chrono::milliseconds>(fast_end_time - fast_start_time);
@@ -130,9 +332,12 @@ inline void OpenCLFast(cv::Mat img, std::string program_source_file, std::string
   // Run non-maximum suppression
   auto nms_start_time = std::chrono::high_resolution_clock::now();
   
-  auto nms_kernel = opencl_helper.CreateKernel(program, "NonMaximumSuppression");
-  opencl_helper.KernelBindArgs(nms_kernel, corner_buffer, nms_buffer, 3);
-  opencl_helper.KernelRun(nms_kernel, image_width, image_height, 1);
+  {
+    TRACE_SCOPE("enqueue_nms");
+    auto nms_kernel = opencl_helper.CreateKernel(program, "NonMaximumSuppression");
+    opencl_helper.KernelBindArgs(nms_kernel, corner_buffer, nms_buffer, 3);
+    opencl_helper.KernelRun(nms_kernel, image_width, image_height, 1);
+  }
   
   auto nms_end_time = std::chrono::high_resolution_clock::now();
   auto nms_duration = std::chrono::duration_cast<std::chrono::milliseconds>(nms_end_time - nms_start_time);
@@ -141,8 +346,11 @@ inline void OpenCLFast(cv::Mat img, std::string program_source_file, std::string
   auto mem_d2h_start = std::chrono::high_resolution_clock::now();
   
   char* output_image_buffer = new char[image_width * image_height];
-  opencl_helper.CopyToHost(nms_buffer, output_image_buffer,
-                           image_width * image_height);
+  {
+    TRACE_SCOPE("copy_to_host");
+    opencl_helper.CopyToHost(nms_buffer, output_image_buffer,
+                             image_width * image_height);
+  }
                            
   auto mem_d2h_end = std::chrono::high_resolution_clock::now();
   auto mem_d2h_duration = std::chrono::duration_cast<std::chrono::milliseconds>(mem_d2h_end - mem_d2h_start);
@@ -151,22 +359,35 @@ inline void OpenCLFast(cv::Mat img, std::string program_source_file, std::string
   auto total_duration = std::chrono::duration_cast<std::chrono::milliseconds>(total_end_time - total_start_time);
   
   cv::Mat opencl_output(image_height, image_width, CV_8UC1, output_image_buffer);
-  cv::imwrite(output_file, opencl_output);
+  {
+    TRACE_SCOPE("imwrite");
+    cv::imwrite(output_file, opencl_output);
+  }
 
   // Convert detected corners to keypoints
   std::vector<cv::KeyPoint> opencl_keypoints;
-  for(int row = 0; row < opencl_output.rows; row++) {
-    for(int col = 0; col < opencl_output.cols; col++) {
-      if(opencl_output.at<uchar>(row, col) > 0) {
-        opencl_keypoints.push_back(cv::KeyPoint(col, row, 3));
+  {
+    TRACE_SCOPE("keypoint_scan");
+    for(int row = 0; row < opencl_output.rows; row++) {
+      for(int col = 0; col < opencl_output.cols; col++) {
+        if(opencl_output.at<uchar>(row, col) > 0) {
+          opencl_keypoints.push_back(cv::KeyPoint(col, row, 3));
+        }
       }
     }
   }
+  TRACE_COUNTER("opencl_keypoints", opencl_keypoints.size());
 
   // Draw keypoints
   cv::Mat fast_opencl_img;
-  cv::drawKeypoints(img, opencl_keypoints, fast_opencl_img);
-  cv::imwrite("fast_opencl.png", fast_opencl_img);
+  {
+    TRACE_SCOPE("drawKeypoints");
+    cv::drawKeypoints(img, opencl_keypoints, fast_opencl_img);
+  }
+  {
+    TRACE_SCOPE("imwrite");
+    cv::imwrite("fast_opencl.png", fast_opencl_img);
+  }
 
   std::cout << "OpenCL Detect : " << opencl_keypoints.size() << std::endl;
   std::cout << "OpenCL Memory H2D Runtime: " << mem_h2d_duration.count() << " ms" << std::endl;
@@ -179,4 +400,49 @@ inline void OpenCLFast(cv::Mat img, std::string program_source_file, std::string
   delete [] output_image_buffer;
 }
 
-}
\ No newline at end of file
+inline void OpenCLORB(OpenCLHelper& opencl_helper, cl_program program, cv::Mat img,
+                      std::string output_file) {
+
+  auto orb_start_time = std::chrono::high_resolution_clock::now();
+
+  std::vector<cv::KeyPoint> orb_keypoints;
+  cv::Mat orb_descriptors;
+  opencl_helper.DetectAndDescribe(program, img, 10, &orb_keypoints, &orb_descriptors);
+
+  auto orb_end_time = std::chrono::high_resolution_clock::now();
+  auto orb_duration = std::chrono::duration_cast<std::chrono::milliseconds>(orb_end_time - orb_start_time);
+
+  cv::Mat orb_opencl_img;
+  cv::drawKeypoints(img, orb_keypoints, orb_opencl_img, cv::Scalar::all(-1),
+                    cv::DrawMatchesFlags::DRAW_RICH_KEYPOINTS);
+  cv::imwrite(output_file, orb_opencl_img);
+
+  std::cout << "OpenCL ORB Detect : " << orb_keypoints.size() << std::endl;
+  std::cout << "OpenCL ORB Descriptors : " << orb_descriptors.rows << " x " << orb_descriptors.cols << std::endl;
+  std::cout << "OpenCL ORB Runtime: " << orb_duration.count() << " ms" << std::endl;
+}
+
+inline void OpenCLFastAdaptive(OpenCLHelper& opencl_helper, cl_program program, cv::Mat img,
+                               std::string output_file, int target_keypoints) {
+  AdaptiveCandidateTarget controller(target_keypoints);
+
+  auto adaptive_start_time = std::chrono::high_resolution_clock::now();
+
+  std::vector<cv::KeyPoint> adaptive_keypoints;
+  opencl_helper.FASTAdaptive(program, img, &controller, &adaptive_keypoints);
+
+  auto adaptive_end_time = std::chrono::high_resolution_clock::now();
+  auto adaptive_duration = std::chrono::duration_cast<std::chrono::milliseconds>(adaptive_end_time - adaptive_start_time);
+
+  cv::Mat adaptive_img;
+  cv::drawKeypoints(img, adaptive_keypoints, adaptive_img);
+  cv::imwrite(output_file, adaptive_img);
+
+  std::cout << "OpenCL Adaptive Detect : " << adaptive_keypoints.size()
+            << " (target " << target_keypoints << ")" << std::endl;
+  std::cout << "OpenCL Adaptive Runtime: " << adaptive_duration.count() << " ms" << std::endl;
+}
+
+}
+
+#endif // OPENCL_HELPER_H
@@ -0,0 +1,231 @@
+#include "trace.h"
+
+#ifdef OPENCLFAST_TRACING
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+namespace trace {
+
+namespace {
+
+const size_t kRingCapacity = 1 << 16;
+
+enum class EventType : uint8_t {
+  Span,
+  Counter,
+  DeviceSpan,
+};
+
+struct Event {
+  const char* name;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  double value;
+  EventType type;
+};
+
+// One ring entry as a seqlock. sequence is 2 * i + 1 while event i is being
+// written and 2 * i + 2 once it is complete; the payload fields are relaxed
+// atomics so a concurrent export reads them without a data race and discards
+// the copy when sequence shows the slot was rewritten meanwhile.
+struct Slot {
+  std::atomic<uint64_t> sequence{0};
+  std::atomic<const char*> name{nullptr};
+  std::atomic<uint64_t> start_ns{0};
+  std::atomic<uint64_t> duration_ns{0};
+  std::atomic<double> value{0.0};
+  std::atomic<EventType> type{EventType::Span};
+};
+
+// Written only by its own thread. The rings stay registered after the thread
+// exits so its events can still be exported.
+struct ThreadRing {
+  uint32_t tid = 0;
+  std::atomic<const char*> thread_name{nullptr};
+  std::atomic<uint64_t> write_index{0};
+  std::vector<Slot> slots = std::vector<Slot>(kRingCapacity);
+
+  void Push(const Event& event) {
+    uint64_t index = write_index.load(std::memory_order_relaxed);
+    Slot& slot = slots[index & (kRingCapacity - 1)];
+    slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(event.name, std::memory_order_relaxed);
+    slot.start_ns.store(event.start_ns, std::memory_order_relaxed);
+    slot.duration_ns.store(event.duration_ns, std::memory_order_relaxed);
+    slot.value.store(event.value, std::memory_order_relaxed);
+    slot.type.store(event.type, std::memory_order_relaxed);
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+    write_index.store(index + 1, std::memory_order_release);
+  }
+
+  // Copies event index into *event, false if the slot no longer (or not yet)
+  // holds it completely
+  bool Read(uint64_t index, Event* event) const {
+    const Slot& slot = slots[index & (kRingCapacity - 1)];
+    uint64_t expected = 2 * index + 2;
+    if (slot.sequence.load(std::memory_order_acquire) != expected) {
+      return false;
+    }
+    event->name = slot.name.load(std::memory_order_relaxed);
+    event->start_ns = slot.start_ns.load(std::memory_order_relaxed);
+    event->duration_ns = slot.duration_ns.load(std::memory_order_relaxed);
+    event->value = slot.value.load(std::memory_order_relaxed);
+    event->type = slot.type.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.sequence.load(std::memory_order_relaxed) == expected;
+  }
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ThreadRing>> rings;
+  // std::set never moves its elements, so c_str() stays valid
+  std::set<std::string> names;
+};
+
+Registry& GetRegistry() {
+  static Registry* registry = new Registry();
+  return *registry;
+}
+
+ThreadRing& LocalRing() {
+  thread_local std::shared_ptr<ThreadRing> ring;
+  if (!ring) {
+    ring = std::make_shared<ThreadRing>();
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    ring->tid = static_cast<uint32_t>(registry.rings.size() + 1);
+    registry.rings.push_back(ring);
+  }
+  return *ring;
+}
+
+void WriteString(std::ostream& os, const std::string& value) {
+  os << '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      os << ' ';
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+// Chrome trace timestamps are microseconds
+double Us(uint64_t ns) { return ns / 1000.0; }
+
+const int kHostPid = 1;
+const int kDevicePid = 2;
+
+}
+
+uint64_t NowNs() {
+  static const auto epoch = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - epoch)
+      .count();
+}
+
+void RecordSpan(const char* name, uint64_t start_ns, uint64_t duration_ns) {
+  LocalRing().Push({name, start_ns, duration_ns, 0.0, EventType::Span});
+}
+
+void RecordCounter(const char* name, double value) {
+  LocalRing().Push({name, NowNs(), 0, value, EventType::Counter});
+}
+
+void RecordDeviceSpan(const char* name, uint64_t start_ns, uint64_t duration_ns) {
+  LocalRing().Push({name, start_ns, duration_ns, 0.0, EventType::DeviceSpan});
+}
+
+const char* InternName(const std::string& name) {
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  return registry.names.insert(name).first->c_str();
+}
+
+void SetThreadName(const char* name) {
+  LocalRing().thread_name.store(name, std::memory_order_relaxed);
+}
+
+bool WriteChromeTrace(const std::string& path) {
+  std::ofstream ofs(path);
+  if (!ofs) {
+    return false;
+  }
+  ofs << std::fixed << std::setprecision(3);
+
+  // Names are never erased, so only the ring list needs the lock
+  std::vector<std::shared_ptr<ThreadRing>> rings;
+  {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    rings = registry.rings;
+  }
+
+  bool first = true;
+  auto separator = [&]() {
+    ofs << (first ? "\n" : ",\n");
+    first = false;
+  };
+
+  ofs << "{\"traceEvents\":[";
+  separator();
+  ofs << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << kHostPid
+      << ",\"args\":{\"name\":\"Host\"}}";
+  separator();
+  ofs << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << kDevicePid
+      << ",\"args\":{\"name\":\"OpenCL device\"}}";
+
+  for (const auto& ring : rings) {
+    const char* thread_name = ring->thread_name.load(std::memory_order_relaxed);
+    if (thread_name) {
+      for (int pid : {kHostPid, kDevicePid}) {
+        separator();
+        ofs << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+            << ",\"tid\":" << ring->tid << ",\"args\":{\"name\":";
+        WriteString(ofs, thread_name);
+        ofs << "}}";
+      }
+    }
+
+    uint64_t end = ring->write_index.load(std::memory_order_acquire);
+    uint64_t begin = end > kRingCapacity ? end - kRingCapacity : 0;
+    for (uint64_t i = begin; i < end; i++) {
+      // The owning thread may still be recording over the oldest events
+      Event event;
+      if (!ring->Read(i, &event)) {
+        continue;
+      }
+      separator();
+      ofs << "{\"name\":";
+      WriteString(ofs, event.name);
+      if (event.type != EventType::Counter) {
+        int pid = event.type == EventType::Span ? kHostPid : kDevicePid;
+        ofs << ",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << ring->tid
+            << ",\"ts\":" << Us(event.start_ns) << ",\"dur\":" << Us(event.duration_ns) << "}";
+      } else {
+        ofs << ",\"ph\":\"C\",\"pid\":" << kHostPid << ",\"tid\":" << ring->tid
+            << ",\"ts\":" << Us(event.start_ns) << ",\"args\":{\"value\":" << event.value << "}}";
+      }
+    }
+  }
+
+  ofs << "\n]}\n";
+  return static_cast<bool>(ofs);
+}
+
+}
+
+#endif // OPENCLFAST_TRACING
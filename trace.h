@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Host-side tracing with Chrome/Perfetto trace export.
+//
+// Compiled in only when OPENCLFAST_TRACING is defined (cmake -DENABLE_TRACING=ON),
+// otherwise every macro below expands to nothing. Spans and counters go to a
+// fixed size ring per thread, so recording never allocates or locks; when a
+// ring is full the oldest events are overwritten. OpenCLHelper adds device
+// spans from OpenCL profiling events to the ring of the thread that waited on
+// them, shown on the device track. TRACE_WRITE may run while other threads
+// record: every ring slot is a seqlock, so events overwritten during the
+// export are left out rather than torn, and the registry lock is only held to
+// copy the ring list, not for the file I/O. Open the file in chrome://tracing
+// or ui.perfetto.dev.
+//
+//   TRACE_SCOPE("imwrite");               span until the end of the scope
+//   TRACE_COUNTER("keypoints", n);        counter sample
+//   TRACE_THREAD_NAME("decode");          label for the calling thread
+//   TRACE_WRITE("fast_trace.json");       export everything recorded so far
+
+#ifdef OPENCLFAST_TRACING
+
+#include <cstdint>
+#include <string>
+
+namespace trace {
+
+// Nanoseconds on the clock used for every event, host and device
+uint64_t NowNs();
+
+void RecordSpan(const char* name, uint64_t start_ns, uint64_t duration_ns);
+void RecordCounter(const char* name, double value);
+void RecordDeviceSpan(const char* name, uint64_t start_ns, uint64_t duration_ns);
+// Stable copy of a name built at run time, such as a kernel function name.
+// Takes the registry lock, intern once and keep the pointer.
+const char* InternName(const std::string& name);
+void SetThreadName(const char* name);
+bool WriteChromeTrace(const std::string& path);
+
+// name must outlive the trace, string literals are expected
+class ScopedSpan {
+public:
+    explicit ScopedSpan(const char* name) : name_(name), start_ns_(NowNs()) {}
+    ~ScopedSpan() { RecordSpan(name_, start_ns_, NowNs() - start_ns_); }
+
+    ScopedSpan(const ScopedSpan&) = delete;
+    ScopedSpan& operator=(const ScopedSpan&) = delete;
+
+private:
+    const char* name_;
+    uint64_t start_ns_;
+};
+
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) ::trace::ScopedSpan TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_COUNTER(name, value) ::trace::RecordCounter(name, static_cast<double>(value))
+#define TRACE_THREAD_NAME(name) ::trace::SetThreadName(name)
+#define TRACE_WRITE(path) ::trace::WriteChromeTrace(path)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_COUNTER(name, value) do {} while (0)
+#define TRACE_THREAD_NAME(name) do {} while (0)
+#define TRACE_WRITE(path) do {} while (0)
+
+#endif // OPENCLFAST_TRACING
+
+#endif // TRACE_H
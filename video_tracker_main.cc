@@ -1,12 +1,39 @@
 #include <opencv2/opencv.hpp>
+#include <chrono>
 #include <iostream>
+#include <string>
+#include <thread>
+#include "adaptive_threshold.h"
+#include "frame_ring.h"
+#include "trace.h"
+
+// A decoded frame and its gray version, converted exactly once on the decode thread
+struct TrackFrame {
+    cv::Mat color;
+    cv::Mat gray;
+};
 
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        std::cout << "Usage: " << argv[0] << " <video_file>" << std::endl;
+    if (argc < 2 || argc > 3) {
+        std::cout << "Usage: " << argv[0] << " <video_file> [--target=N]" << std::endl;
         return -1;
     }
 
+    // With --target the FAST threshold follows the keypoint count frame to frame
+    int target_keypoints = 0;
+    if (argc == 3) {
+        std::string arg = argv[2];
+        const std::string target_flag = "--target=";
+        if (arg.rfind(target_flag, 0) == 0) {
+            target_keypoints = std::atoi(arg.substr(target_flag.size()).c_str());
+        }
+        if (target_keypoints <= 0) {
+            std::cout << "Unknown argument : " << arg << std::endl;
+            return -1;
+        }
+    }
+    AdaptiveThreshold threshold_controller(target_keypoints > 0 ? target_keypoints : 1);
+
     // Open video file
     cv::VideoCapture cap(argv[1]);
     if (!cap.isOpened()) {
@@ -14,36 +41,70 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    cv::Mat prev_frame, curr_frame;
-    
+    // Decoding and gray conversion run on their own thread and hand frames over
+    // through the ring. Frames are swapped in and out of the ring, so the same
+    // few buffers are reused for the whole video.
+    FrameRing<TrackFrame, 8> frame_ring;
+    std::thread decode_thread([&cap, &frame_ring]() {
+        TRACE_THREAD_NAME("decode");
+        TrackFrame frame;
+        while (true) {
+            {
+                TRACE_SCOPE("decode");
+                if (!cap.read(frame.color) || frame.color.empty())
+                    break;
+            }
+            {
+                TRACE_SCOPE("cvtColor");
+                cv::cvtColor(frame.color, frame.gray, cv::COLOR_BGR2GRAY);
+            }
+            TRACE_SCOPE("ring_push");
+            if (!frame_ring.Push(frame))
+                break;
+        }
+        frame_ring.Close();
+    });
+    TRACE_THREAD_NAME("track");
+
+    TrackFrame prev_frame, curr_frame;
+
     // Read first frame
-    cap >> prev_frame;
-    if (prev_frame.empty()) {
+    if (!frame_ring.Pop(prev_frame)) {
         std::cout << "Error reading video" << std::endl;
+        decode_thread.join();
         return -1;
     }
 
     // Create window
     cv::namedWindow("Video Tracking", cv::WINDOW_NORMAL);
 
+    size_t frame_count = 0;
+    auto start_time = std::chrono::high_resolution_clock::now();
+
     while (true) {
-        // Read current frame
-        cap >> curr_frame;
-        if (curr_frame.empty())
+        bool has_frame;
+        {
+            // Time spent here means tracking is waiting on the decoder
+            TRACE_SCOPE("ring_pop");
+            has_frame = frame_ring.Pop(curr_frame);
+        }
+        if (!has_frame)
             break;
-
-        // Create combined image
-        cv::Mat display;
-        // Convert frames to grayscale
-        cv::Mat prev_gray, curr_gray;
-        cv::cvtColor(prev_frame, prev_gray, cv::COLOR_BGR2GRAY);
-        cv::cvtColor(curr_frame, curr_gray, cv::COLOR_BGR2GRAY);
+        frame_count++;
 
         // Detect FAST corners in previous frame
         std::vector<cv::Point2f> prev_corners;
         std::vector<cv::KeyPoint> keypoints;
-        int threshold = 20;
-        cv::FAST(prev_gray, keypoints, threshold, true);
+        int threshold = target_keypoints > 0 ? threshold_controller.Threshold() : 20;
+        {
+            TRACE_SCOPE("fast");
+            cv::FAST(prev_frame.gray, keypoints, threshold, true);
+        }
+        TRACE_COUNTER("keypoints", keypoints.size());
+        TRACE_COUNTER("threshold", threshold);
+        if (target_keypoints > 0) {
+            threshold_controller.Update(keypoints.size());
+        }
         
         // Convert keypoints to points for optical flow
         for(const auto& kp : keypoints) {
@@ -54,39 +115,56 @@ int main(int argc, char** argv) {
         std::vector<cv::Point2f> curr_corners;
         std::vector<uchar> status;
         std::vector<float> err;
-        cv::calcOpticalFlowPyrLK(prev_gray, curr_gray, prev_corners, curr_corners, status, err);
-
-        // Draw the tracks
-        for(size_t i = 0; i < prev_corners.size(); i++) {
-            if(status[i]) {
-                // Draw point in prev_frame
-                cv::circle(prev_frame, prev_corners[i], 3, cv::Scalar(0, 255, 0), -1);
-                
-                // Draw point in curr_frame
-                cv::circle(curr_frame, curr_corners[i], 3, cv::Scalar(0, 255, 0), -1);
-            }
+        {
+            TRACE_SCOPE("optical_flow");
+            cv::calcOpticalFlowPyrLK(prev_frame.gray, curr_frame.gray, prev_corners, curr_corners, status, err);
         }
-        cv::hconcat(prev_frame, curr_frame, display);
 
-        // Draw line from prev_frame to curr_frame showing motion
-        for(size_t i = 0; i < prev_corners.size(); i++) {
-            if(status[i]) {
-                cv::line(display, prev_corners[i], curr_corners[i] + cv::Point2f(prev_frame.cols, 0), cv::Scalar(0, 255, 0));
+        // Create combined image, the tracks are drawn on it so the frames stay clean
+        cv::Mat display;
+        {
+            TRACE_SCOPE("draw");
+            cv::hconcat(prev_frame.color, curr_frame.color, display);
+
+            // Draw the tracks and a line from prev_frame to curr_frame showing motion
+            cv::Point2f curr_offset(prev_frame.color.cols, 0);
+            for(size_t i = 0; i < prev_corners.size(); i++) {
+                if(status[i]) {
+                    cv::circle(display, prev_corners[i], 3, cv::Scalar(0, 255, 0), -1);
+                    cv::circle(display, curr_corners[i] + curr_offset, 3, cv::Scalar(0, 255, 0), -1);
+                    cv::line(display, prev_corners[i], curr_corners[i] + curr_offset, cv::Scalar(0, 255, 0));
+                }
             }
         }
 
         // Show the combined image
-        cv::imshow("Video Tracking", display);
+        {
+            TRACE_SCOPE("imshow");
+            cv::imshow("Video Tracking", display);
+        }
 
-        // Update previous frame
-        curr_frame.copyTo(prev_frame);
+        // Update previous frame, the old one goes back to the ring on the next Pop
+        std::swap(prev_frame, curr_frame);
 
         // Break if 'q' is pressed
-        char c = (char)cv::waitKey(25);
+        char c;
+        {
+            TRACE_SCOPE("waitKey");
+            c = (char)cv::waitKey(1);
+        }
         if (c == 'q')
             break;
     }
 
+    auto end_time = std::chrono::high_resolution_clock::now();
+    double elapsed_s = std::chrono::duration<double>(end_time - start_time).count();
+    if (frame_count > 0 && elapsed_s > 0) {
+        std::cout << "Tracked " << frame_count << " frames at " << frame_count / elapsed_s << " FPS" << std::endl;
+    }
+
+    frame_ring.Close();
+    decode_thread.join();
+    TRACE_WRITE("video_track_trace.json");
     cap.release();
     cv::destroyAllWindows();
 